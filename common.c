@@ -2,7 +2,7 @@
 #include <config.h>
 #endif
 #include <gst/gst.h>
-
+#include <errno.h>
 
 #include "common.h"
 #include "gstdvbsink-marshal.h"
@@ -68,6 +68,18 @@ void pes_set_pts(long long timestamp, unsigned char *pes_header)
 	pes_header[13] = 0x01 | ((pts << 1) & 0xFE);
 }
 
+/*
+ * how far (ns) a timestamp written with pes_set_pts() is ahead of the pts the
+ * decoder reports, both are compared as 33 bit 90kHz values so a wrap in
+ * between doesn't matter
+ */
+gint64 pes_pts_lead(GstClockTime timestamp, gint64 decoder_pts)
+{
+	gint64 lead = ((timestamp * 9LL / 100000) - decoder_pts) & 0x1FFFFFFFFLL;
+	if (lead & 0x100000000LL) lead -= 0x200000000LL;
+	return lead * 100000 / 9;
+}
+
 void pes_set_payload_size(size_t size, unsigned char *pes_header)
 {
 	if (size > 0xffff) size = 0;
@@ -75,6 +87,623 @@ void pes_set_payload_size(size_t size, unsigned char *pes_header)
 	pes_header[5] = size & 0xFF;
 }
 
+/* empties the unlock pipe, whatever woke the poll is in the flags */
+void dvb_read_unlock(int unlockfd)
+{
+	gchar command;
+	while (read(unlockfd, &command, 1) >= 0);
+}
+
+/* writes the front of the pause queue, returns 1 when something was written,
+ * 0 when the queue is empty and -3 on a write error */
+int dvb_write_queue(dvb_sink_io_t *io)
+{
+	size_t queuestart, queueend;
+	GstBuffer *queuebuffer;
+	GstMapInfo queuemap;
+	int retval = 1;
+
+	GST_OBJECT_LOCK(io->element);
+	if (queue_front(io->queue, &queuebuffer, &queuestart, &queueend) < 0)
+	{
+		GST_OBJECT_UNLOCK(io->element);
+		return 0;
+	}
+	gst_buffer_map(queuebuffer, &queuemap, GST_MAP_READ);
+	int wr = write(*io->fd, queuemap.data + queuestart, queueend - queuestart);
+	gst_buffer_unmap(queuebuffer, &queuemap);
+	if (wr < 0)
+	{
+		if (errno != EINTR && errno != EAGAIN) retval = -3;
+	}
+	else if (wr >= queueend - queuestart)
+	{
+		queue_pop(io->queue);
+		GST_CAT_TRACE_OBJECT(io->category, io->element, "written %d queue bytes... pop entry", wr);
+	}
+	else
+	{
+		(*io->queue)->start += wr;
+		GST_CAT_TRACE_OBJECT(io->category, io->element, "written %d queue bytes... update offset", wr);
+	}
+	GST_OBJECT_UNLOCK(io->element);
+	return retval;
+}
+
+/*
+ * collects what a sink would write into spans, to go out later with
+ * dvb_write_gathered(). A buffer which is rewritten for every packet (the pes
+ * header) is copied into headers, the others are referenced, one span per
+ * memory since mapping the whole buffer would merge them into a copy.
+ */
+void dvb_gather(GArray *spans, GByteArray *headers, GstBuffer *buffer, gboolean copy, size_t start, size_t end)
+{
+	dvb_span_t span;
+
+	if (end <= start) return;
+	if (copy)
+	{
+		span.buffer = NULL;
+		span.memory = 0;
+		span.offset = 0;
+		span.start = headers->len;
+		span.end = span.start + end - start;
+		g_byte_array_set_size(headers, span.end);
+		gst_buffer_extract(buffer, start, headers->data + span.start, end - start);
+		g_array_append_val(spans, span);
+	}
+	else
+	{
+		guint i, n_memory = gst_buffer_n_memory(buffer);
+		gsize offset = 0;
+		for (i = 0; i < n_memory && offset < end; i++)
+		{
+			gsize size = gst_memory_get_sizes(gst_buffer_peek_memory(buffer, i), NULL, NULL);
+			span.start = MAX(start, offset);
+			span.end = MIN(offset + size, end);
+			if (span.end > span.start)
+			{
+				span.buffer = gst_buffer_ref(buffer);
+				span.memory = i;
+				span.offset = offset;
+				g_array_append_val(spans, span);
+			}
+			offset += size;
+		}
+	}
+}
+
+void dvb_gather_clear(GArray *spans, GByteArray *headers)
+{
+	guint i;
+
+	for (i = 0; i < spans->len; i++)
+	{
+		dvb_span_t *span = &g_array_index(spans, dvb_span_t, i);
+		if (span->buffer) gst_buffer_unref(span->buffer);
+	}
+	g_array_set_size(spans, 0);
+	g_byte_array_set_size(headers, 0);
+}
+
+/*
+ * writes everything gathered with as few writev calls as the decoder allows,
+ * after what is left in the pause queue. Once the sink pauses or unlocks the
+ * rest goes to the pause queue, on a flush it is skipped. Leaves the spans
+ * to the caller to clear, returns < 0 on errors.
+ */
+int dvb_write_gathered(dvb_sink_io_t *io, GArray *spans, GByteArray *headers)
+{
+	guint n = spans->len;
+	dvb_span_t *span_data = (dvb_span_t *)spans->data;
+	struct iovec *iov = g_new(struct iovec, n);
+	GstMapInfo *map = g_new(GstMapInfo, n);
+	struct pollfd pfd[2];
+	guint i, span = 0;
+	int retval = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if (span_data[i].buffer)
+		{
+			gst_buffer_map_range(span_data[i].buffer, span_data[i].memory, 1, &map[i], GST_MAP_READ);
+			iov[i].iov_base = map[i].data + span_data[i].start - span_data[i].offset;
+		}
+		else
+		{
+			iov[i].iov_base = headers->data + span_data[i].start;
+		}
+		iov[i].iov_len = span_data[i].end - span_data[i].start;
+	}
+
+	pfd[0].fd = *io->unlockfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = *io->fd;
+	pfd[1].events = POLLOUT | io->events;
+
+	while (span < n)
+	{
+		if (*io->flushing)
+		{
+			GST_CAT_INFO_OBJECT(io->category, io->element, "flushing, skip %u spans", n - span);
+			break;
+		}
+		else if (*io->paused || *io->unlocking)
+		{
+			GST_OBJECT_LOCK(io->element);
+			for (; span < n; span++)
+			{
+				if (span_data[span].buffer)
+				{
+					queue_push(io->queue, span_data[span].buffer, span_data[span].end - iov[span].iov_len, span_data[span].end);
+				}
+				else
+				{
+					/* header bytes need a buffer of their own to live in the queue */
+					GstBuffer *header = gst_buffer_new_allocate(NULL, iov[span].iov_len, NULL);
+					gst_buffer_fill(header, 0, iov[span].iov_base, iov[span].iov_len);
+					queue_push(io->queue, header, 0, iov[span].iov_len);
+					gst_buffer_unref(header);
+				}
+			}
+			GST_OBJECT_UNLOCK(io->element);
+			GST_CAT_TRACE_OBJECT(io->category, io->element, "pushed gathered spans to queue");
+			break;
+		}
+		if (io->skip_poll)
+		{
+			pfd[0].revents = 0;
+			pfd[1].revents = POLLOUT;
+		}
+		else
+		{
+			gint64 poll_start = g_get_monotonic_time();
+			if (poll(pfd, 2, -1) < 0)
+			{
+				if (errno == EINTR) continue;
+				retval = -1;
+				break;
+			}
+			if (io->poll_wait) *io->poll_wait += g_get_monotonic_time() - poll_start;
+		}
+		if (pfd[0].revents & POLLIN)
+		{
+			/* read all stop commands */
+			dvb_read_unlock(*io->unlockfd);
+			continue;
+		}
+		if ((pfd[1].revents & io->events) && io->handle_event)
+		{
+			io->handle_event(io->element);
+		}
+		if (pfd[1].revents & POLLOUT)
+		{
+			int queued = dvb_write_queue(io);
+			if (queued < 0)
+			{
+				retval = queued;
+				break;
+			}
+			if (queued) continue;
+			int wr = writev(*io->fd, iov + span, MIN(n - span, DVB_WRITE_MAX_IOV));
+			if (wr < 0)
+			{
+				if (errno == EINTR || errno == EAGAIN) continue;
+				retval = -3;
+				break;
+			}
+			/* skip what went out, the last span may be partially written */
+			while (span < n && wr >= iov[span].iov_len)
+			{
+				wr -= iov[span].iov_len;
+				span++;
+			}
+			if (span < n)
+			{
+				iov[span].iov_base = (guint8 *)iov[span].iov_base + wr;
+				iov[span].iov_len -= wr;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (span_data[i].buffer) gst_buffer_unmap(span_data[i].buffer, &map[i]);
+	}
+	g_free(map);
+	g_free(iov);
+	return retval;
+}
+
+/*
+ * waits until the decoder pts is no more than limit behind pts, the pts of
+ * the data about to be written. Upstream bursts then pile up in front of the
+ * sink while the decoder is fed at the rate it plays. Only normal playback
+ * is paced, and only once the decoder reports a pts of what was written.
+ */
+void dvb_pace(dvb_sink_io_t *io, GstClockTime pts, GstClockTime limit)
+{
+	struct pollfd pfd[2];
+
+	if (pts == GST_CLOCK_TIME_NONE || !limit)
+	{
+		return;
+	}
+
+	pfd[0].fd = *io->unlockfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = *io->fd;
+	pfd[1].events = io->events;
+
+	while (*io->rate == 1.0 && *io->playing && *io->pts_written && !*io->flushing && !*io->paused && !*io->unlocking)
+	{
+		gint64 cur = 0, lead;
+		int timeout;
+
+		/* nothing decoded yet, the decoder has to fill up first */
+		if (ioctl(*io->fd, io->get_pts, &cur) < 0 || !cur) break;
+		lead = pes_pts_lead(pts, cur);
+		if (lead <= (gint64)limit || lead > DVB_PACING_MAX_LEAD) break;
+
+		timeout = MIN((lead - (gint64)limit) / GST_MSECOND + 1, DVB_PACING_POLL_MS);
+		GST_CAT_TRACE_OBJECT(io->category, io->element, "decoder lead %" G_GINT64_FORMAT " ms, pacing for %d ms", lead / GST_MSECOND, timeout);
+		if (poll(pfd, io->events ? 2 : 1, timeout) < 0)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (pfd[0].revents & POLLIN)
+		{
+			/* read all stop commands */
+			dvb_read_unlock(*io->unlockfd);
+		}
+		if (io->events && (pfd[1].revents & io->events) && io->handle_event)
+		{
+			io->handle_event(io->element);
+		}
+	}
+}
+
+/*
+ * posts buffering messages while the data written ahead of the decoder pts
+ * is below low_watermark and 100% once it is back above it. Data going to
+ * the pause queue counts as written, so the lead keeps growing while a
+ * player pauses to rebuffer.
+ */
+void dvb_report_lead(dvb_sink_io_t *io, GstClockTime pts, GstClockTime low_watermark)
+{
+	gint64 cur = 0, lead;
+	gint percent;
+
+	if (pts == GST_CLOCK_TIME_NONE || !low_watermark || !*io->pts_written || *io->rate != 1.0) return;
+	if (ioctl(*io->fd, io->get_pts, &cur) < 0 || !cur) return;
+	lead = pes_pts_lead(pts, cur);
+	if (lead > DVB_PACING_MAX_LEAD) return;
+
+	if (lead >= (gint64)low_watermark) percent = 100;
+	else percent = lead > 0 ? lead * 100 / low_watermark : 0;
+	if (percent == io->buffering_percent) return;
+
+	GST_CAT_DEBUG_OBJECT(io->category, io->element, "decoder lead %" G_GINT64_FORMAT " ms, buffering %d%%", lead / GST_MSECOND, percent);
+	io->buffering_percent = percent;
+	gst_element_post_message(io->element, gst_message_new_buffering(GST_OBJECT(io->element), percent));
+}
+
+/* a flush or stop empties the decoder, a player waiting for it isn't left paused */
+void dvb_reset_lead(dvb_sink_io_t *io)
+{
+	if (io->buffering_percent < 100)
+	{
+		io->buffering_percent = 100;
+		gst_element_post_message(io->element, gst_message_new_buffering(GST_OBJECT(io->element), 100));
+	}
+}
+
+/*
+ * common.c is built once, as libdvbmediasink-common, which all the plugins
+ * link against. The registry is therefore one per process, whichever of the
+ * sinks are loaded.
+ */
+typedef struct dvb_device_registry
+{
+	GMutex lock;
+	dvb_device_t *devices;
+	/* wakes the reaper, and the sinks waiting for a handle being torn down */
+	GCond cond;
+	GThread *reaper;
+	gboolean reaper_done;
+} dvb_device_registry_t;
+
+/* statically allocated mutexes and conds need no init */
+static dvb_device_registry_t registry;
+
+/* also waits for a handle the reaper is tearing down to be gone */
+static dvb_device_t *dvb_device_find_locked(int type, int adapter, int decoder)
+{
+	dvb_device_t *device = registry.devices;
+
+	while (device)
+	{
+		if (device->type == type && device->adapter == adapter && device->decoder == decoder)
+		{
+			if (!device->closing) return device;
+			/* the list may change while we wait, start over */
+			g_cond_wait(&registry.cond, &registry.lock);
+			device = registry.devices;
+			continue;
+		}
+		device = device->next;
+	}
+	return NULL;
+}
+
+static dvb_device_t *dvb_device_new_locked(int type, int adapter, int decoder)
+{
+	dvb_device_t *device;
+	char path[64];
+	int fd;
+
+	sprintf(path, "/dev/dvb/adapter%d/%s%d", adapter, type == DVB_DEVICE_VIDEO ? "video" : "audio", decoder);
+	fd = open(path, O_RDWR | O_NONBLOCK);
+	if (fd < 0) return NULL;
+
+	device = g_malloc0(sizeof(dvb_device_t));
+	device->type = type;
+	device->adapter = adapter;
+	device->decoder = decoder;
+	device->fd = fd;
+	device->refcount = 1;
+	device->rate = 1.0;
+	device->frozen = FALSE;
+	device->source = -1;
+	device->stream_type = -1;
+	device->next = registry.devices;
+	registry.devices = device;
+	return device;
+}
+
+static void dvb_device_remove_locked(dvb_device_t *device)
+{
+	dvb_device_t **link;
+
+	for (link = &registry.devices; *link; link = &(*link)->next)
+	{
+		if (*link == device)
+		{
+			*link = device->next;
+			break;
+		}
+	}
+}
+
+static void dvb_device_unref_locked(dvb_device_t *device)
+{
+	if (--device->refcount > 0) return;
+
+	dvb_device_remove_locked(device);
+	close(device->fd);
+	g_free(device);
+}
+
+/* undo what the sink skipped when it parked the handle, then close it */
+static void dvb_device_teardown(dvb_device_t *device)
+{
+	if (device->type == DVB_DEVICE_VIDEO)
+	{
+		if (device->playing) ioctl(device->fd, VIDEO_STOP);
+		if (device->rate != 1.0)
+		{
+			ioctl(device->fd, VIDEO_SLOWMOTION, 0);
+			ioctl(device->fd, VIDEO_FAST_FORWARD, 0);
+		}
+		ioctl(device->fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_DEMUX);
+		if (device->fallback_framerate && device->saved_fallback_framerate[0])
+		{
+			char path[64];
+			FILE *f;
+			sprintf(path, "/proc/stb/vmpeg/%d/fallback_framerate", device->decoder);
+			f = fopen(path, "w");
+			if (f)
+			{
+				fputs(device->saved_fallback_framerate, f);
+				fclose(f);
+			}
+		}
+	}
+	else
+	{
+		if (device->playing) ioctl(device->fd, AUDIO_STOP);
+		ioctl(device->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_DEMUX);
+	}
+	close(device->fd);
+}
+
+/*
+ * Tears down parked handles once their deadline passed. The ioctls run
+ * without the registry lock, a sink opening the same decoder meanwhile waits
+ * for the handle to be gone. The thread ends when nothing is parked anymore,
+ * the next dvb_device_park() or dvb_device_close() joins it. Nothing runs at
+ * exit: a process ending within DVB_DEVICE_PARK_TIME leaves what is still
+ * parked to the kernel, which closes it like any other fd.
+ */
+static gpointer dvb_device_reaper(gpointer data)
+{
+	g_mutex_lock(&registry.lock);
+	while (1)
+	{
+		dvb_device_t *device, *expired = NULL;
+		gint64 now = g_get_monotonic_time();
+		gint64 next = G_MAXINT64;
+
+		for (device = registry.devices; device; device = device->next)
+		{
+			if (!device->parked || device->closing) continue;
+			if (device->park_deadline <= now)
+			{
+				expired = device;
+				break;
+			}
+			if (device->park_deadline < next) next = device->park_deadline;
+		}
+		if (expired)
+		{
+			expired->closing = TRUE;
+			g_mutex_unlock(&registry.lock);
+			dvb_device_teardown(expired);
+			g_mutex_lock(&registry.lock);
+			dvb_device_remove_locked(expired);
+			g_free(expired);
+			g_cond_broadcast(&registry.cond);
+			continue;
+		}
+		if (next == G_MAXINT64) break;
+		g_cond_wait_until(&registry.cond, &registry.lock, next);
+	}
+	registry.reaper_done = TRUE;
+	g_mutex_unlock(&registry.lock);
+	return NULL;
+}
+
+/* a reaper which ran out of parked handles only has to be joined, it has
+ * already let go of the lock for good */
+static void dvb_device_join_reaper_locked(void)
+{
+	if (registry.reaper && registry.reaper_done)
+	{
+		g_thread_join(registry.reaper);
+		registry.reaper = NULL;
+	}
+}
+
+/*
+ * returns the handle to /dev/dvb/adapterX/{audio,video}Y, or NULL when the
+ * device can't be opened. Like the driver, a decoder has only one sink at a
+ * time, a second open fails with EBUSY. A parked handle is reclaimed as is,
+ * its state fields tell the sink what is already programmed.
+ */
+dvb_device_t *dvb_device_open(int type, int adapter, int decoder)
+{
+	dvb_device_t *device;
+	int err = 0;
+
+	g_mutex_lock(&registry.lock);
+	device = dvb_device_find_locked(type, adapter, decoder);
+	if (device && device->refcount)
+	{
+		device = NULL;
+		err = EBUSY;
+	}
+	else if (device)
+	{
+		device->refcount = 1;
+		device->parked = FALSE;
+	}
+	else
+	{
+		device = dvb_device_new_locked(type, adapter, decoder);
+		if (!device) err = errno;
+	}
+	g_mutex_unlock(&registry.lock);
+	if (!device) errno = err;
+	return device;
+}
+
+void dvb_device_close(dvb_device_t *device)
+{
+	if (!device) return;
+
+	g_mutex_lock(&registry.lock);
+	dvb_device_unref_locked(device);
+	dvb_device_join_reaper_locked();
+	g_mutex_unlock(&registry.lock);
+}
+
+/*
+ * Like dvb_device_close(), but the device stays open for DVB_DEVICE_PARK_TIME
+ * with the given state, so that the next sink can pick it up where we left
+ * it. Returns FALSE when the handle can't be parked, it is then still the
+ * caller's to stop and close.
+ */
+gboolean dvb_device_park(dvb_device_t *device, gboolean playing, int stream_type, const char *saved_fallback_framerate)
+{
+	gboolean parked = FALSE;
+
+	if (!device) return FALSE;
+
+	g_mutex_lock(&registry.lock);
+	if (device->refcount == 1)
+	{
+		device->refcount = 0;
+		device->playing = playing;
+		device->stream_type = stream_type;
+		if (saved_fallback_framerate)
+		{
+			g_strlcpy(device->saved_fallback_framerate, saved_fallback_framerate, sizeof(device->saved_fallback_framerate));
+		}
+		device->parked = TRUE;
+		device->park_deadline = g_get_monotonic_time() + DVB_DEVICE_PARK_TIME;
+		dvb_device_join_reaper_locked();
+		if (!registry.reaper)
+		{
+			registry.reaper_done = FALSE;
+			registry.reaper = g_thread_new("dvbdevicereaper", dvb_device_reaper, NULL);
+		}
+		g_cond_broadcast(&registry.cond);
+		parked = TRUE;
+	}
+	g_mutex_unlock(&registry.lock);
+	return parked;
+}
+
+/*
+ * Both sinks receive the same segment, only the first one to see a new rate
+ * programs the video decoder. The audio sink does not hold the video device,
+ * so it is opened here for the duration of the call if nobody else has it.
+ */
+void dvb_device_set_rate(int adapter, int decoder, gdouble rate)
+{
+	dvb_device_t *device, *temporary = NULL;
+
+	g_mutex_lock(&registry.lock);
+	device = dvb_device_find_locked(DVB_DEVICE_VIDEO, adapter, decoder);
+	if (!device)
+	{
+		device = temporary = dvb_device_new_locked(DVB_DEVICE_VIDEO, adapter, decoder);
+	}
+	if (device && device->rate != rate)
+	{
+		int skip = 0, repeat = 0;
+		if (rate > 1.0)
+		{
+			skip = (int)rate;
+		}
+		else if (rate < 1.0)
+		{
+			repeat = 1.0 / rate;
+		}
+		ioctl(device->fd, VIDEO_SLOWMOTION, repeat);
+		ioctl(device->fd, VIDEO_FAST_FORWARD, skip);
+		/* a paused video sink keeps the decoder frozen, don't undo that */
+		if (!device->frozen) ioctl(device->fd, VIDEO_CONTINUE);
+		device->rate = rate;
+	}
+	if (temporary) dvb_device_unref_locked(temporary);
+	g_mutex_unlock(&registry.lock);
+}
+
+void dvb_device_video_freeze(dvb_device_t *device, gboolean freeze)
+{
+	if (!device) return;
+
+	g_mutex_lock(&registry.lock);
+	if (device->frozen != freeze)
+	{
+		ioctl(device->fd, freeze ? VIDEO_FREEZE : VIDEO_CONTINUE);
+		device->frozen = freeze;
+	}
+	g_mutex_unlock(&registry.lock);
+}
+
 void gst_sleepms(uint32_t msec)
 {
 	//does not interfere with signals like sleep and usleep do
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/dvb/audio.h>
 #include <linux/dvb/video.h>
 #include <fcntl.h>
@@ -30,6 +31,101 @@ int queue_front(queue_entry_t **queue_base, GstBuffer **buffer, size_t *start, s
 
 void pes_set_pts(long long timestamp, unsigned char *pes_header);
 void pes_set_payload_size(size_t size, unsigned char *pes_header);
+gint64 pes_pts_lead(GstClockTime timestamp, gint64 decoder_pts);
+
+/* part of a buffer gathered for dvb_write_gathered(), it lies in one memory
+ * of the buffer which starts at offset, buffer is NULL for bytes copied into
+ * the headers of the gather */
+typedef struct dvb_span
+{
+	GstBuffer *buffer;
+	guint memory;
+	gsize offset, start, end;
+} dvb_span_t;
+
+/*
+ * what the shared write loops need of a sink, set up once by the sink. The
+ * pointers go into the sink, the write loops read them on every turn since
+ * other threads change them and wake the poll through the unlock pipe.
+ */
+typedef struct dvb_sink_io
+{
+	GstElement *element;
+	GstDebugCategory *category;
+	/* the decoder and the read end of the unlock pipe */
+	const int *fd, *unlockfd;
+	/* VIDEO_GET_PTS or AUDIO_GET_PTS */
+	unsigned long get_pts;
+	/* polled for on top of POLLOUT, handle_event reads what came in */
+	short events;
+	void (*handle_event)(GstElement *element);
+	/* the decoder never signals POLLOUT, writes just block */
+	gboolean skip_poll;
+	const gboolean *playing, *paused, *flushing, *unlocking, *pts_written;
+	const gdouble *rate;
+	/* the pause queue, guarded by the object lock of element */
+	queue_entry_t **queue;
+	/* time spent polling for the decoder to take data (us), may be NULL */
+	gint64 *poll_wait;
+	/* last buffering percentage posted, 100 while not buffering */
+	gint buffering_percent;
+} dvb_sink_io_t;
+
+/* most spans dvb_write_gathered() hands to one writev */
+#define DVB_WRITE_MAX_IOV 64
+/* longest single wait of dvb_pace(), flushes and state changes wake it earlier */
+#define DVB_PACING_POLL_MS 100
+/* a larger lead is a discontinuity rather than a burst, it is not waited out */
+#define DVB_PACING_MAX_LEAD (10 * GST_SECOND)
+
+void dvb_read_unlock(int unlockfd);
+int dvb_write_queue(dvb_sink_io_t *io);
+void dvb_gather(GArray *spans, GByteArray *headers, GstBuffer *buffer, gboolean copy, size_t start, size_t end);
+void dvb_gather_clear(GArray *spans, GByteArray *headers);
+int dvb_write_gathered(dvb_sink_io_t *io, GArray *spans, GByteArray *headers);
+void dvb_pace(dvb_sink_io_t *io, GstClockTime pts, GstClockTime limit);
+void dvb_report_lead(dvb_sink_io_t *io, GstClockTime pts, GstClockTime low_watermark);
+void dvb_reset_lead(dvb_sink_io_t *io);
+
+#define DVB_DEVICE_AUDIO 0
+#define DVB_DEVICE_VIDEO 1
+
+/* decoder handle of one sink, registered process wide, see dvb_device_open() */
+typedef struct dvb_device
+{
+	struct dvb_device *next;
+	int type;
+	int adapter;
+	int decoder;
+	int fd;
+	/* 1 while a sink has it, 0 while parked */
+	int refcount;
+	/* video decoder state, only touched with the registry lock held */
+	gdouble rate;
+	gboolean frozen;
+	/*
+	 * state kept while a handle is parked (keep-device-open), only touched
+	 * by the sink owning the handle or by the registry once it is parked
+	 */
+	int source;
+	int stream_type;
+	gboolean playing;
+	int fallback_framerate;
+	char saved_fallback_framerate[16];
+	gboolean parked;
+	gint64 park_deadline;
+	/* the reaper is tearing it down, it can't be reclaimed anymore */
+	gboolean closing;
+} dvb_device_t;
+
+/* how long a parked handle waits for a new sink before it is closed (us) */
+#define DVB_DEVICE_PARK_TIME (2 * G_TIME_SPAN_SECOND)
+
+dvb_device_t *dvb_device_open(int type, int adapter, int decoder);
+void dvb_device_close(dvb_device_t *device);
+gboolean dvb_device_park(dvb_device_t *device, gboolean playing, int stream_type, const char *saved_fallback_framerate);
+void dvb_device_set_rate(int adapter, int decoder, gdouble rate);
+void dvb_device_video_freeze(dvb_device_t *device, gboolean freeze);
 
 void gst_sleepms(uint32_t msec);
 void gst_sleepus(uint32_t usec);
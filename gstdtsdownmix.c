@@ -43,6 +43,7 @@
 #include "common.h"
 #include <dca.h>
 #include "gstdtsdownmix.h"
+#include "gstdvbdtsaudiosink.h"
 
 #if HAVE_ORC
 #include <orc/orc.h>
@@ -64,13 +65,23 @@
 #define SAMPLE_TYPE GST_AUDIO_FORMAT_F32
 #endif
 
+/* a DTS frame holds at most 4096 samples, 16 libdca blocks */
+#define DTS_MAX_BLOCKS 16
+
+/* offset making float samples carry their s16 value in the mantissa */
+#define DTS_S16_BIAS 384
+
 GST_DEBUG_CATEGORY_STATIC (dtsdownmix_debug);
 #define GST_CAT_DEFAULT (dtsdownmix_debug)
 
 enum
 {
   PROP_0,
-  PROP_DRC
+  PROP_DRC,
+  PROP_INTEGER_OUTPUT,
+  PROP_DECODE_PATH,
+  PROP_THREADED_DECODE,
+  PROP_FRAMES_PER_BUFFER
 };
 
 static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
@@ -83,7 +94,7 @@ static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_SOMETIMES,
     GST_STATIC_CAPS ("audio/x-raw, "
-        "format = (string) " SAMPLE_FORMAT ", "
+        "format = (string) { " SAMPLE_FORMAT ", S16LE, S16BE }, "
         "layout = (string) interleaved, "
         "rate = (int) [ 4000, 48000 ], " "channels = (int) [ 1, 6 ]")
     );
@@ -91,15 +102,26 @@ static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
 G_DEFINE_TYPE (GstDtsDec, gst_dtsdownmix, GST_TYPE_AUDIO_DECODER);
 static gboolean gst_dtsdownmix_start (GstAudioDecoder * dec);
 static gboolean gst_dtsdownmix_stop (GstAudioDecoder * dec);
+static void gst_dtsdownmix_flush (GstAudioDecoder * dec, gboolean hard);
+static gboolean gst_dtsdownmix_decide_allocation (GstAudioDecoder * dec,
+    GstQuery * query);
 static gboolean gst_dtsdownmix_set_format (GstAudioDecoder * bdec, GstCaps * caps);
 static gboolean gst_dtsdownmix_parse (GstAudioDecoder * dec, GstAdapter * adapter,
     gint * offset, gint * length);
 static GstFlowReturn gst_dtsdownmix_handle_frame (GstAudioDecoder * dec,
     GstBuffer * buffer);
+static void gst_dtsdownmix_interleave_generic (gpointer dst,
+    const sample_t * src, const gint * reorder_map, gint chans);
 
 static GstFlowReturn gst_dtsdownmix_chain (GstPad * pad, GstObject * parent,
     GstBuffer * buf);
 
+static void gst_dtsdownmix_finalize (GObject * object);
+static GstDtsJob *gst_dtsdownmix_worker_wait (GstDtsDec * dts);
+static void gst_dtsdownmix_worker_stop (GstDtsDec * dts);
+static void gst_dtsdownmix_output_drop (GstDtsDec * dts);
+static gpointer gst_dtsdownmix_worker_loop (gpointer data);
+
 static void gst_dtsdownmix_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
 static void gst_dtsdownmix_get_property (GObject * object, guint prop_id,
@@ -119,6 +141,7 @@ gst_dtsdownmix_class_init (GstDtsDecClass * klass)
 
   gobject_class->set_property = gst_dtsdownmix_set_property;
   gobject_class->get_property = gst_dtsdownmix_get_property;
+  gobject_class->finalize = gst_dtsdownmix_finalize;
 
   gst_element_class_add_pad_template (gstelement_class,
       gst_static_pad_template_get (&sink_factory));
@@ -132,6 +155,9 @@ gst_dtsdownmix_class_init (GstDtsDecClass * klass)
 
   gstbase_class->start = GST_DEBUG_FUNCPTR (gst_dtsdownmix_start);
   gstbase_class->stop = GST_DEBUG_FUNCPTR (gst_dtsdownmix_stop);
+  gstbase_class->flush = GST_DEBUG_FUNCPTR (gst_dtsdownmix_flush);
+  gstbase_class->decide_allocation =
+      GST_DEBUG_FUNCPTR (gst_dtsdownmix_decide_allocation);
   gstbase_class->set_format = GST_DEBUG_FUNCPTR (gst_dtsdownmix_set_format);
   gstbase_class->parse = GST_DEBUG_FUNCPTR (gst_dtsdownmix_parse);
   gstbase_class->handle_frame = GST_DEBUG_FUNCPTR (gst_dtsdownmix_handle_frame);
@@ -150,9 +176,55 @@ gst_dtsdownmix_class_init (GstDtsDecClass * klass)
           "Use Dynamic Range Compression", FALSE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * GstDtsDec::integer-output
+   *
+   * Always output native endian S16, converted and saturated while
+   * interleaving, instead of only when downstream prefers it.
+   */
+  g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_INTEGER_OUTPUT,
+      g_param_spec_boolean ("integer-output", "Integer output",
+          "Output S16 instead of floating point samples", FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstDtsDec::decode-path
+   *
+   * Which libdca build and output conversion are in use, and whether
+   * decoding runs on its own thread.
+   */
+  g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_DECODE_PATH,
+      g_param_spec_string ("decode-path", "Decode path",
+          "Active decode and output conversion path", NULL,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstDtsDec::threaded-decode
+   *
+   * Decode on a separate thread, so frame N+1 is decoded while frame N is
+   * interleaved and pushed downstream. Adds one frame of delay, output
+   * order and timestamps are kept. Applied on the next start.
+   */
+  g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_THREADED_DECODE,
+      g_param_spec_boolean ("threaded-decode", "Threaded decode",
+          "Decode the next frame while the current one is pushed", FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstDtsDec::frames-per-buffer
+   *
+   * Decode this many DTS frames into one output buffer before finishing
+   * them, trading latency for fewer allocations, pushes and PES packets
+   * in the sink.
+   */
+  g_object_class_install_property (G_OBJECT_CLASS (klass),
+      PROP_FRAMES_PER_BUFFER, g_param_spec_uint ("frames-per-buffer",
+          "Frames per buffer", "Number of DTS frames gathered per output buffer",
+          1, 32, 1, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   klass->dts_cpuflags = 0;
 
-#if HAVE_ORC
+#if HAVE_ORC && (defined(__i386__) || defined(__x86_64__))
   cpuflags = orc_target_get_default_flags (orc_target_get_by_name ("mmx"));
   if (cpuflags & ORC_TARGET_MMX_MMX)
     klass->dts_cpuflags |= MM_ACCEL_X86_MMX;
@@ -173,6 +245,11 @@ gst_dtsdownmix_init (GstDtsDec * dtsdownmix)
 {
   dtsdownmix->request_channels = DCA_CHANNEL | DCA_STEREO;
   dtsdownmix->dynamic_range_compression = FALSE;
+  dtsdownmix->integer_output = FALSE;
+  dtsdownmix->threaded_decode = FALSE;
+  dtsdownmix->frames_per_buffer = 1;
+  g_mutex_init (&dtsdownmix->worker_lock);
+  g_cond_init (&dtsdownmix->worker_cond);
   dtsdownmix->stream_started = 0;
   GST_INFO_OBJECT(dtsdownmix, "DTSDOWNMIX_INIT");
   /* retrieve and intercept base class chain.
@@ -183,6 +260,43 @@ gst_dtsdownmix_init (GstDtsDec * dtsdownmix)
       GST_DEBUG_FUNCPTR (gst_dtsdownmix_chain));
 }
 
+static void
+gst_dtsdownmix_finalize (GObject * object)
+{
+  GstDtsDec *dts = GST_DTSDOWNMIX (object);
+
+  g_mutex_clear (&dts->worker_lock);
+  g_cond_clear (&dts->worker_cond);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static gchar *
+gst_dtsdownmix_describe_path (GstDtsDec * dts)
+{
+  const gchar *decode, *output;
+
+#if defined(LIBDTS_FIXED) || defined(LIBDCA_FIXED)
+  decode = "fixed point";
+  output = "s16";
+#else
+#if defined(LIBDTS_DOUBLE) || defined(LIBDCA_DOUBLE)
+  decode = "double";
+#else
+  decode = "float";
+#endif
+  if (dts->bias != 0)
+    output = "s16 from biased float";
+  else if (dts->output_format != SAMPLE_TYPE)
+    output = "s16 converted";
+  else
+    output = decode;
+#endif
+
+  return g_strdup_printf ("%s decode%s, %s output", decode,
+      dts->threaded_decode ? " on its own thread" : "", output);
+}
+
 static gboolean gst_dtsdownmix_start (GstAudioDecoder * dec)
 {
 	FILE *f;
@@ -200,15 +314,38 @@ static gboolean gst_dtsdownmix_start (GstAudioDecoder * dec)
    
 	klass = GST_DTSDOWNMIX_CLASS (G_OBJECT_GET_CLASS (dts));
 	dts->state = dca_init (klass->dts_cpuflags);
+	dts->parse_state = dca_init (klass->dts_cpuflags);
 	dts->samples = dca_samples (dts->state);
 	dts->bit_rate = -1;
 	dts->sample_rate = -1;
+	dts->output_rate = -1;
+	dts->sync_length = 0;
+	dts->latency_set = FALSE;
 	dts->stream_channels = DCA_CHANNEL;
 	dts->using_channels = DCA_CHANNEL;
 	dts->level = 1;
 	dts->bias = 0;
+#if !defined(LIBDTS_FIXED) && !defined(LIBDCA_FIXED) && !defined(LIBDTS_DOUBLE) && !defined(LIBDCA_DOUBLE)
+	/* integer output: let libdca offset the samples so that the s16 value
+	 * can be taken straight from the float bits, no float math per sample */
+	if (dts->integer_output)
+		dts->bias = DTS_S16_BIAS;
+#endif
 	dts->flag_update = TRUE;
+	dts->interleave = gst_dtsdownmix_interleave_generic;
+	dts->output_format = SAMPLE_TYPE;
+	dts->output_width = SAMPLE_WIDTH;
+
+	if (dts->threaded_decode) {
+		dts->worker_quit = FALSE;
+		dts->worker = g_thread_new ("dtsdecode", gst_dtsdownmix_worker_loop, dts);
+	}
 
+	{
+		gchar *path = gst_dtsdownmix_describe_path (dts);
+		GST_INFO_OBJECT (dts, "decode path: %s", path);
+		g_free (path);
+	}
 	/* call upon legacy upstream byte support (e.g. seeking) */
 	gst_audio_decoder_set_estimate_rate (dec, TRUE);
 	//gst_audio_decoder_set_max_errors(dec, 100);
@@ -229,12 +366,24 @@ gst_dtsdownmix_stop (GstAudioDecoder * dec)
 
 	GST_INFO_OBJECT (dec, "stop");
 
+	gst_dtsdownmix_worker_stop (dts);
+	gst_dtsdownmix_output_drop (dts);
+	if (dts->pool) {
+		gst_buffer_pool_set_active (dts->pool, FALSE);
+		gst_object_unref (dts->pool);
+		dts->pool = NULL;
+		dts->pool_size = 0;
+	}
 	dts->base_chain = NULL;
 	dts->samples = NULL;
 	if (dts->state) {
 		dca_free (dts->state);
 		dts->state = NULL;
 	}
+	if (dts->parse_state) {
+		dca_free (dts->parse_state);
+		dts->parse_state = NULL;
+	}
 	FILE *f;
 	f = fopen("/tmp/dtsdownmix", "w");
 	if (f)
@@ -245,47 +394,199 @@ gst_dtsdownmix_stop (GstAudioDecoder * dec)
 	return TRUE;
 }
 
+static void
+gst_dtsdownmix_flush (GstAudioDecoder * dec, gboolean hard)
+{
+  GstDtsDec *dts = GST_DTSDOWNMIX (dec);
+  GstDtsJob *done;
+
+  dts->sync_length = 0;
+  gst_dtsdownmix_output_drop (dts);
+  if (!dts->worker)
+    return;
+
+  /* the base class drops its pending frames, drop the decoded one too */
+  done = gst_dtsdownmix_worker_wait (dts);
+  if (done)
+    gst_buffer_replace (&done->buffer, NULL);
+}
+
+/* 16 and 14 bit sync words, big and little endian */
+#define DTS_SYNC_BE16 0x7ffe8001
+#define DTS_SYNC_LE16 0xfe7f0180
+#define DTS_SYNC_BE14 0x1fffe800
+#define DTS_SYNC_LE14 0xff1f00e8
+/* what dca_syncinfo() looks at */
+#define DTS_HEADER_SIZE 14
+
+/* offset of the next sync word candidate at or after pos, -1 if none */
+static gint
+gst_dtsdownmix_find_sync (const guint8 * data, gint pos, gint size)
+{
+  guint32 word;
+
+  if (size - pos < 4)
+    return -1;
+
+  word = GST_READ_UINT32_BE (data + pos);
+  while (TRUE) {
+    if (word == DTS_SYNC_BE16 || word == DTS_SYNC_LE16 ||
+        word == DTS_SYNC_BE14 || word == DTS_SYNC_LE14)
+      return pos;
+    if (pos + 4 >= size)
+      return -1;
+    word = (word << 8) | data[pos + 4];
+    pos++;
+  }
+}
+
+static gboolean
+gst_dtsdownmix_configure_pool (GstBufferPool * pool, guint size, guint min,
+    guint max, GstAllocator * allocator, GstAllocationParams * params)
+{
+  GstStructure *config = gst_buffer_pool_get_config (pool);
+
+  gst_buffer_pool_config_set_params (config, NULL, size, min, max);
+  gst_buffer_pool_config_set_allocator (config, allocator, params);
+  return gst_buffer_pool_set_config (pool, config);
+}
+
+/* one pool sized for the largest frame times frames-per-buffer, taken over
+ * from downstream when it proposes an inactive one that takes that size */
+static gboolean
+gst_dtsdownmix_decide_allocation (GstAudioDecoder * dec, GstQuery * query)
+{
+  GstDtsDec *dts = GST_DTSDOWNMIX (dec);
+  GstAudioInfo *info = gst_audio_decoder_get_audio_info (dec);
+  GstBufferPool *pool = NULL;
+  GstAllocator *allocator = NULL;
+  GstAllocationParams params;
+  guint size, pool_size = 0, min = 0, max = 0;
+
+  if (!GST_AUDIO_DECODER_CLASS (parent_class)->decide_allocation (dec, query))
+    return FALSE;
+
+  size = DTS_MAX_BLOCKS * 256 * GST_AUDIO_INFO_BPF (info) *
+      dts->frames_per_buffer;
+
+  if (gst_query_get_n_allocation_pools (query) > 0)
+    gst_query_parse_nth_allocation_pool (query, 0, &pool, &pool_size, &min,
+        &max);
+  size = MAX (size, pool_size);
+  /* one being filled, one being written by the sink */
+  min = MAX (min, 2);
+  /* an active pool is in use downstream and can't be reconfigured */
+  if (pool && gst_buffer_pool_is_active (pool)) {
+    GST_DEBUG_OBJECT (dts, "proposed pool is active, using a private one");
+    gst_object_unref (pool);
+    pool = NULL;
+  }
+
+  gst_allocation_params_init (&params);
+  if (gst_query_get_n_allocation_params (query) > 0)
+    gst_query_parse_nth_allocation_param (query, 0, &allocator, &params);
+
+  if (pool && !gst_dtsdownmix_configure_pool (pool, size, min, max, allocator,
+          &params)) {
+    GST_DEBUG_OBJECT (dts, "proposed pool refused %u byte buffers, "
+        "using a private one", size);
+    gst_object_unref (pool);
+    pool = NULL;
+  }
+  if (!pool) {
+    pool = gst_buffer_pool_new ();
+    if (!gst_dtsdownmix_configure_pool (pool, size, min, max, allocator,
+            &params)) {
+      GST_WARNING_OBJECT (dts, "pool refused %u byte buffers, not pooling",
+          size);
+      gst_object_unref (pool);
+      pool = NULL;
+    }
+  }
+  if (allocator)
+    gst_object_unref (allocator);
+
+  if (pool) {
+    if (gst_query_get_n_allocation_pools (query) > 0)
+      gst_query_set_nth_allocation_pool (query, 0, pool, size, min, max);
+    else
+      gst_query_add_allocation_pool (query, pool, size, min, max);
+    gst_buffer_pool_set_active (pool, TRUE);
+  }
+
+  if (dts->pool) {
+    gst_buffer_pool_set_active (dts->pool, FALSE);
+    gst_object_unref (dts->pool);
+  }
+  dts->pool = pool;
+  dts->pool_size = pool ? size : 0;
+
+  return TRUE;
+}
+
 static GstFlowReturn
 gst_dtsdownmix_parse (GstAudioDecoder * bdec, GstAdapter * adapter,
     gint * _offset, gint * len)
 {
   GstDtsDec *dts;
   guint8 *data;
-  gint av, size;
+  gint av, pos;
   gint length = 0, flags, sample_rate, bit_rate, frame_length;
   GstFlowReturn result = GST_FLOW_EOS;
 
   dts = GST_DTSDOWNMIX (bdec);
 
-  size = av = gst_adapter_available (adapter);
+  av = gst_adapter_available (adapter);
+
+  /* header already checked on the last call, only the payload was missing */
+  if (dts->sync_length > 0 && av < dts->sync_length) {
+    *_offset = 0;
+    *len = dts->sync_length;
+    return GST_FLOW_EOS;
+  }
+  dts->sync_length = 0;
+
+  if (av < DTS_HEADER_SIZE) {
+    *_offset = 0;
+    *len = 0;
+    return GST_FLOW_EOS;
+  }
+
   data = (guint8 *) gst_adapter_map (adapter, av);
 
-  /* find and read header */
+  /* only call into libdca where a sync word is */
   bit_rate = dts->bit_rate;
   sample_rate = dts->sample_rate;
   flags = 0;
-  while (size >= 7) {
-    length = dca_syncinfo (dts->state, data, &flags,
-        &sample_rate, &bit_rate, &frame_length);
-
-    if (length <= 0) {
-      /* shift window to re-find sync */
-	  GST_INFO_OBJECT (dts, "OUT OF SYNC LENGHT = %d", length);
-      data++;
-      size--;
-    } else if (length <= size) {
-      GST_LOG_OBJECT (dts, "Sync: frame size %d", length);
-      result = GST_FLOW_OK;
+  pos = 0;
+  while ((pos = gst_dtsdownmix_find_sync (data, pos, av)) >= 0) {
+    if (av - pos < DTS_HEADER_SIZE)
       break;
-    } else {
-      GST_INFO_OBJECT (dts, "Not enough data available (needed %d had %d)",
-          length, size);
+    length = dca_syncinfo (dts->parse_state, data + pos, &flags,
+        &sample_rate, &bit_rate, &frame_length);
+    if (length > 0)
       break;
-    }
+    pos++;
   }
   gst_adapter_unmap (adapter);
 
-  *_offset = av - size;
+  if (pos < 0) {
+    /* keep what could be the start of a sync word */
+    pos = av - 3;
+    length = 0;
+  } else if (length > 0 && length <= av - pos) {
+    GST_LOG_OBJECT (dts, "Sync: frame size %d", length);
+    result = GST_FLOW_OK;
+  } else if (length > 0) {
+    GST_LOG_OBJECT (dts, "Not enough data available (needed %d had %d)",
+        length, av - pos);
+    dts->sync_length = length;
+  }
+
+  if (pos > 0)
+    GST_DEBUG_OBJECT (dts, "skipped %d bytes looking for sync", pos);
+
+  *_offset = pos;
   *len = length;
 
   return result;
@@ -383,6 +684,203 @@ gst_dtsdownmix_channels (uint32_t flags, GstAudioChannelPosition * pos)
   return chans;
 }
 
+/* saturated conversion to s16, no dither */
+static inline gint16
+gst_dtsdownmix_to_s16 (sample_t sample)
+{
+  sample_t value = sample * 32768;
+
+  value = value > 32767 ? 32767 : value;
+  value = value < -32768 ? -32768 : value;
+  return (gint16) value;
+}
+
+/*
+ * With bias 384 and level 1 every float sample sits in [256, 512), where the
+ * exponent is constant and one mantissa step is 1 / 32768, so the low bits
+ * are the s16 value. Same trick as the a52dec convert routines.
+ */
+static inline gint16
+gst_dtsdownmix_bias_to_s16 (sample_t sample)
+{
+  union
+  {
+    sample_t f;
+    gint32 i;
+  } u;
+  gint32 value;
+
+  u.f = sample;
+  value = u.i - 0x43c00000;
+  value = value > 32767 ? 32767 : value;
+  value = value < -32768 ? -32768 : value;
+  return (gint16) value;
+}
+
+#define DTS_TO_SAMPLE(x) (x)
+#define DTS_TO_S16(x) gst_dtsdownmix_to_s16 (x)
+#define DTS_TO_S16_SWAP(x) ((gint16) GUINT16_SWAP_LE_BE ((guint16) gst_dtsdownmix_to_s16 (x)))
+#define DTS_BIAS_TO_S16(x) gst_dtsdownmix_bias_to_s16 (x)
+
+/*
+ * Interleave kernels, one set per output format, with the conversion fused
+ * in. The specialized ones have the reorder map built in.
+ */
+#define DTS_INTERLEAVE_KERNELS(suffix, type, convert) \
+static void \
+gst_dtsdownmix_interleave_generic##suffix (gpointer dst, const sample_t * src, \
+    const gint * reorder_map, gint chans) \
+{ \
+  gint n, c; \
+ \
+  for (c = 0; c < chans; c++) { \
+    type *out = (type *) dst + reorder_map[c]; \
+    const sample_t *in = src + c * 256; \
+ \
+    for (n = 0; n < 256; n++) \
+      out[n * chans] = convert (in[n]); \
+  } \
+} \
+ \
+/* FL FR, already in gstreamer order */ \
+static void \
+gst_dtsdownmix_interleave_2_0##suffix (gpointer dst, const sample_t * src, \
+    const gint * reorder_map, gint chans) \
+{ \
+  type *out = dst; \
+  gint n; \
+ \
+  for (n = 0; n < 256; n++) { \
+    out[2 * n] = convert (src[n]); \
+    out[2 * n + 1] = convert (src[256 + n]); \
+  } \
+} \
+ \
+/* FL FR LFE, already in gstreamer order */ \
+static void \
+gst_dtsdownmix_interleave_2_1##suffix (gpointer dst, const sample_t * src, \
+    const gint * reorder_map, gint chans) \
+{ \
+  type *out = dst; \
+  gint n; \
+ \
+  for (n = 0; n < 256; n++) { \
+    out[3 * n] = convert (src[n]); \
+    out[3 * n + 1] = convert (src[256 + n]); \
+    out[3 * n + 2] = convert (src[512 + n]); \
+  } \
+} \
+ \
+/* FC FL FR RL RR LFE to FL FR FC LFE RL RR */ \
+static void \
+gst_dtsdownmix_interleave_5_1##suffix (gpointer dst, const sample_t * src, \
+    const gint * reorder_map, gint chans) \
+{ \
+  type *out = dst; \
+  gint n; \
+ \
+  for (n = 0; n < 256; n++) { \
+    out[6 * n] = convert (src[256 + n]); \
+    out[6 * n + 1] = convert (src[512 + n]); \
+    out[6 * n + 2] = convert (src[n]); \
+    out[6 * n + 3] = convert (src[1280 + n]); \
+    out[6 * n + 4] = convert (src[768 + n]); \
+    out[6 * n + 5] = convert (src[1024 + n]); \
+  } \
+}
+
+DTS_INTERLEAVE_KERNELS (, sample_t, DTS_TO_SAMPLE)
+DTS_INTERLEAVE_KERNELS (_s16, gint16, DTS_TO_S16)
+DTS_INTERLEAVE_KERNELS (_s16_swap, gint16, DTS_TO_S16_SWAP)
+#if !defined(LIBDTS_FIXED) && !defined(LIBDCA_FIXED) && !defined(LIBDTS_DOUBLE) && !defined(LIBDCA_DOUBLE)
+DTS_INTERLEAVE_KERNELS (_s16_bias, gint16, DTS_BIAS_TO_S16)
+#endif
+
+static GstDtsInterleaveFunc
+gst_dtsdownmix_pick_interleave (const gint * reorder_map, gint chans,
+    GstAudioFormat format, gboolean biased)
+{
+  static const gint map_2_0[] = { 0, 1 };
+  static const gint map_2_1[] = { 0, 1, 2 };
+  static const gint map_5_1[] = { 2, 0, 1, 4, 5, 3 };
+  /* generic, 2.0, 2.1, 5.1 */
+  static const GstDtsInterleaveFunc sample_kernels[] = {
+    gst_dtsdownmix_interleave_generic, gst_dtsdownmix_interleave_2_0,
+    gst_dtsdownmix_interleave_2_1, gst_dtsdownmix_interleave_5_1
+  };
+  static const GstDtsInterleaveFunc s16_kernels[] = {
+    gst_dtsdownmix_interleave_generic_s16, gst_dtsdownmix_interleave_2_0_s16,
+    gst_dtsdownmix_interleave_2_1_s16, gst_dtsdownmix_interleave_5_1_s16
+  };
+  static const GstDtsInterleaveFunc s16_swap_kernels[] = {
+    gst_dtsdownmix_interleave_generic_s16_swap,
+    gst_dtsdownmix_interleave_2_0_s16_swap,
+    gst_dtsdownmix_interleave_2_1_s16_swap,
+    gst_dtsdownmix_interleave_5_1_s16_swap
+  };
+#if !defined(LIBDTS_FIXED) && !defined(LIBDCA_FIXED) && !defined(LIBDTS_DOUBLE) && !defined(LIBDCA_DOUBLE)
+  static const GstDtsInterleaveFunc s16_bias_kernels[] = {
+    gst_dtsdownmix_interleave_generic_s16_bias,
+    gst_dtsdownmix_interleave_2_0_s16_bias,
+    gst_dtsdownmix_interleave_2_1_s16_bias,
+    gst_dtsdownmix_interleave_5_1_s16_bias
+  };
+#endif
+  const GstDtsInterleaveFunc *kernels = sample_kernels;
+
+  if (format != SAMPLE_TYPE)
+    kernels = format == GST_AUDIO_FORMAT_S16 ? s16_kernels : s16_swap_kernels;
+#if !defined(LIBDTS_FIXED) && !defined(LIBDCA_FIXED) && !defined(LIBDTS_DOUBLE) && !defined(LIBDCA_DOUBLE)
+  /* samples decoded with the bias only make sense to the bias kernels */
+  if (biased)
+    kernels = s16_bias_kernels;
+#endif
+
+  /* only take a specialized kernel when it matches what gstreamer resolved */
+  if (chans == 2 && !memcmp (reorder_map, map_2_0, sizeof (map_2_0)))
+    return kernels[1];
+  if (chans == 3 && !memcmp (reorder_map, map_2_1, sizeof (map_2_1)))
+    return kernels[2];
+  if (chans == 6 && !memcmp (reorder_map, map_5_1, sizeof (map_5_1)))
+    return kernels[3];
+  return kernels[0];
+}
+
+/* s16 output when forced through the property or when downstream prefers it */
+static GstAudioFormat
+gst_dtsdownmix_pick_format (GstDtsDec * dts)
+{
+  GstAudioFormat format = SAMPLE_TYPE;
+  GstCaps *caps;
+
+#if defined(LIBDTS_FIXED) || defined(LIBDCA_FIXED)
+  /* the fixed point decoder doesn't produce floats to convert */
+  return format;
+#endif
+  /* a biased decoder is committed to s16 until the next start */
+  if (dts->integer_output || dts->bias != 0)
+    return GST_AUDIO_FORMAT_S16;
+
+  caps = gst_pad_get_allowed_caps (GST_AUDIO_DECODER_SRC_PAD (dts));
+  if (caps && gst_caps_get_size (caps) > 0) {
+    GstCaps *copy = gst_caps_copy_nth (caps, 0);
+    GstStructure *structure = gst_caps_get_structure (copy, 0);
+    const gchar *name;
+
+    gst_structure_fixate_field_string (structure, "format", SAMPLE_FORMAT);
+    name = gst_structure_get_string (structure, "format");
+    if (name && !strcmp (name, "S16LE"))
+      format = GST_AUDIO_FORMAT_S16LE;
+    else if (name && !strcmp (name, "S16BE"))
+      format = GST_AUDIO_FORMAT_S16BE;
+    gst_caps_unref (copy);
+  }
+  if (caps)
+    gst_caps_unref (caps);
+
+  return format;
+}
+
 static gboolean
 gst_dtsdownmix_renegotiate (GstDtsDec * dts)
 {
@@ -397,17 +895,24 @@ gst_dtsdownmix_renegotiate (GstDtsDec * dts)
     goto done;
 
   GST_INFO_OBJECT (dts, "dtsdownmix renegotiate, channels=%d, rate=%d",
-      channels, dts->sample_rate);
+      channels, dts->output_rate);
 
   memcpy (to, from, sizeof (GstAudioChannelPosition) * channels);
   gst_audio_channel_positions_to_valid_order (to, channels);
   gst_audio_get_channel_reorder_map (channels, from, to,
       dts->channel_reorder_map);
 
+  dts->output_format = gst_dtsdownmix_pick_format (dts);
+  dts->output_width = dts->output_format == SAMPLE_TYPE ? SAMPLE_WIDTH : 16;
+  dts->interleave =
+      gst_dtsdownmix_pick_interleave (dts->channel_reorder_map, channels,
+      dts->output_format, dts->bias != 0);
+
 
   gst_audio_info_init (&info);
   gst_audio_info_set_format (&info,
-      SAMPLE_TYPE, dts->sample_rate, channels, (channels > 1 ? to : NULL));
+      dts->output_format, dts->output_rate, channels,
+      (channels > 1 ? to : NULL));
 
   if (!gst_audio_decoder_set_output_format (GST_AUDIO_DECODER (dts), &info))
     goto done;
@@ -433,25 +938,329 @@ gst_dtsdownmix_update_streaminfo (GstDtsDec * dts)
   }
 }
 
+/* finishes the frames gathered so far as one buffer */
+static GstFlowReturn
+gst_dtsdownmix_output_push (GstDtsDec * dts)
+{
+  GstBuffer *outbuf = dts->out_pending;
+  gint frames = dts->out_frames;
+
+  if (!outbuf)
+    return GST_FLOW_OK;
+
+  gst_buffer_unmap (outbuf, &dts->out_map);
+  gst_buffer_set_size (outbuf, dts->out_fill);
+  dts->out_pending = NULL;
+  dts->out_fill = 0;
+  dts->out_frames = 0;
+
+  if (!frames) {
+    gst_buffer_unref (outbuf);
+    return GST_FLOW_OK;
+  }
+  return gst_audio_decoder_finish_frame (GST_AUDIO_DECODER (dts), outbuf,
+      frames);
+}
+
+static void
+gst_dtsdownmix_output_drop (GstDtsDec * dts)
+{
+  if (!dts->out_pending)
+    return;
+
+  gst_buffer_unmap (dts->out_pending, &dts->out_map);
+  gst_buffer_unref (dts->out_pending);
+  dts->out_pending = NULL;
+  dts->out_fill = 0;
+  dts->out_frames = 0;
+}
+
+/* room for one decoded frame, in the pending buffer while it still fits */
+static guint8 *
+gst_dtsdownmix_output_reserve (GstDtsDec * dts, gsize size,
+    GstFlowReturn * result)
+{
+  if (dts->out_pending && dts->out_fill + size > dts->out_map.size) {
+    *result = gst_dtsdownmix_output_push (dts);
+    if (*result != GST_FLOW_OK)
+      return NULL;
+  }
+
+  if (!dts->out_pending) {
+    gsize wanted = size * dts->frames_per_buffer;
+
+    /* the pool is sized for the largest frame, anything else is a one off */
+    if (!dts->pool || wanted > dts->pool_size ||
+        gst_buffer_pool_acquire_buffer (dts->pool, &dts->out_pending,
+            NULL) != GST_FLOW_OK)
+      dts->out_pending =
+          gst_audio_decoder_allocate_output_buffer (GST_AUDIO_DECODER (dts),
+          wanted);
+    gst_buffer_map (dts->out_pending, &dts->out_map, GST_MAP_WRITE);
+  }
+
+  return dts->out_map.data + dts->out_fill;
+}
+
+static GstFlowReturn
+gst_dtsdownmix_output_commit (GstDtsDec * dts, gsize size, gint samples)
+{
+  dts->out_fill += size;
+  dts->out_frames++;
+
+  /* frames held back, by the aggregation and the decode thread */
+  if (!dts->latency_set) {
+    gint held = dts->frames_per_buffer - 1 + (dts->worker ? 1 : 0);
+    GstClockTime latency =
+        gst_util_uint64_scale_int (samples * held, GST_SECOND,
+        dts->output_rate);
+
+    gst_audio_decoder_set_latency (GST_AUDIO_DECODER (dts), latency, latency);
+    dts->latency_set = TRUE;
+  }
+
+  if (dts->out_frames >= dts->frames_per_buffer)
+    return gst_dtsdownmix_output_push (dts);
+  return GST_FLOW_OK;
+}
+
+/* renegotiate when the decoded channel layout or the rate changed */
+static GstFlowReturn
+gst_dtsdownmix_update_output (GstDtsDec * dts, gint channels, gint sample_rate)
+{
+  GstFlowReturn result;
+
+  if (dts->using_channels == channels && dts->output_rate == sample_rate)
+    return GST_FLOW_OK;
+
+  /* what was gathered goes out in the old format */
+  result = gst_dtsdownmix_output_push (dts);
+  if (result != GST_FLOW_OK)
+    return result;
+
+  dts->using_channels = channels;
+  dts->output_rate = sample_rate;
+  dts->latency_set = FALSE;
+  GST_DEBUG_OBJECT (dts,
+      "dtsdownmix: sample_rate:%d stream_chans:0x%x using_chans:0x%x",
+      dts->output_rate, dts->stream_channels, dts->using_channels);
+  /* negotiate now, so the pool is set up for the new format before the
+   * next frame is written into it */
+  if (!gst_dtsdownmix_renegotiate (dts) ||
+      !gst_audio_decoder_negotiate (GST_AUDIO_DECODER (dts))) {
+    GST_ELEMENT_ERROR (dts, CORE, NEGOTIATION, (NULL), (NULL));
+    return GST_FLOW_ERROR;
+  }
+  return GST_FLOW_OK;
+}
+
+/* decode thread side: header, drc and all blocks into job->samples */
+static void
+gst_dtsdownmix_decode_job (GstDtsDec * dts, GstDtsJob * job)
+{
+  GstMapInfo map;
+  sample_t level = 1;
+  gint chans, i, n;
+  gsize block_size;
+
+  job->failed = FALSE;
+  job->failed_block = -1;
+  job->num_blocks = 0;
+
+  gst_buffer_map (job->buffer, &map, GST_MAP_READ);
+  if (dca_frame (dts->state, map.data, &job->flags, &level, dts->bias)) {
+    gst_buffer_unmap (job->buffer, &map);
+    job->failed = TRUE;
+    return;
+  }
+  gst_buffer_unmap (job->buffer, &map);
+
+  if (job->drc == FALSE)
+    dca_dynrng (dts->state, NULL, NULL);
+
+  job->flags &= (DCA_CHANNEL_MASK | DCA_LFE);
+  chans = gst_dtsdownmix_channels (job->flags, NULL);
+  if (!chans)
+    return;
+
+  job->num_blocks = dca_blocks_num (dts->state);
+  block_size = 256 * chans;
+  if (job->samples_size < block_size * job->num_blocks) {
+    job->samples_size = block_size * job->num_blocks;
+    job->samples = g_renew (sample_t, job->samples, job->samples_size);
+  }
+
+  for (i = 0; i < job->num_blocks; i++) {
+    sample_t *out = job->samples + i * block_size;
+
+    if (dca_block (dts->state)) {
+      if (job->failed_block < 0)
+        job->failed_block = i;
+      /* silence, which is the bias itself for the biased s16 path */
+      for (n = 0; n < block_size; n++)
+        out[n] = dts->bias;
+    } else {
+      memcpy (out, dts->samples, block_size * sizeof (sample_t));
+    }
+  }
+}
+
+static gpointer
+gst_dtsdownmix_worker_loop (gpointer data)
+{
+  GstDtsDec *dts = data;
+  GstDtsJob *job;
+
+  g_mutex_lock (&dts->worker_lock);
+  while (TRUE) {
+    while (!dts->worker_job && !dts->worker_quit)
+      g_cond_wait (&dts->worker_cond, &dts->worker_lock);
+    if (dts->worker_quit)
+      break;
+    job = dts->worker_job;
+    g_mutex_unlock (&dts->worker_lock);
+
+    gst_dtsdownmix_decode_job (dts, job);
+
+    g_mutex_lock (&dts->worker_lock);
+    dts->worker_job = NULL;
+    dts->worker_done = job;
+    g_cond_broadcast (&dts->worker_cond);
+  }
+  g_mutex_unlock (&dts->worker_lock);
+
+  return NULL;
+}
+
+/* waits for the frame in flight, returns it decoded or NULL when idle */
+static GstDtsJob *
+gst_dtsdownmix_worker_wait (GstDtsDec * dts)
+{
+  GstDtsJob *done;
+
+  g_mutex_lock (&dts->worker_lock);
+  while (dts->worker_job)
+    g_cond_wait (&dts->worker_cond, &dts->worker_lock);
+  done = dts->worker_done;
+  dts->worker_done = NULL;
+  g_mutex_unlock (&dts->worker_lock);
+
+  return done;
+}
+
+static void
+gst_dtsdownmix_worker_submit (GstDtsDec * dts, GstDtsJob * job)
+{
+  g_mutex_lock (&dts->worker_lock);
+  dts->worker_job = job;
+  g_cond_broadcast (&dts->worker_cond);
+  g_mutex_unlock (&dts->worker_lock);
+}
+
+static void
+gst_dtsdownmix_worker_stop (GstDtsDec * dts)
+{
+  gint i;
+
+  if (!dts->worker)
+    return;
+
+  g_mutex_lock (&dts->worker_lock);
+  dts->worker_quit = TRUE;
+  g_cond_broadcast (&dts->worker_cond);
+  g_mutex_unlock (&dts->worker_lock);
+  g_thread_join (dts->worker);
+  dts->worker = NULL;
+
+  dts->worker_job = dts->worker_done = NULL;
+  for (i = 0; i < 2; i++) {
+    gst_buffer_replace (&dts->jobs[i].buffer, NULL);
+    g_free (dts->jobs[i].samples);
+    dts->jobs[i].samples = NULL;
+    dts->jobs[i].samples_size = 0;
+  }
+  dts->next_job = 0;
+}
+
+/* streaming thread side: negotiate, interleave and push a decoded frame */
+static GstFlowReturn
+gst_dtsdownmix_finish_job (GstDtsDec * dts, GstDtsJob * job)
+{
+  GstAudioDecoder *bdec = GST_AUDIO_DECODER (dts);
+  GstFlowReturn result = GST_FLOW_OK;
+  guint8 *out;
+  gsize block_bytes;
+  gint chans, i;
+
+  gst_buffer_replace (&job->buffer, NULL);
+
+  if (job->failed) {
+    GST_AUDIO_DECODER_ERROR (dts, 1, STREAM, DECODE, (NULL),
+        ("dts_frame error"), result);
+    /* drop it, so the next frames keep their own timestamps */
+    if (result == GST_FLOW_OK)
+      result = gst_dtsdownmix_output_push (dts);
+    if (result == GST_FLOW_OK)
+      result = gst_audio_decoder_finish_frame (bdec, NULL, 1);
+    return result;
+  }
+
+  result = gst_dtsdownmix_update_output (dts, job->flags, job->sample_rate);
+  if (result != GST_FLOW_OK)
+    return result;
+
+  chans = gst_dtsdownmix_channels (job->flags, NULL);
+  if (!chans) {
+    GST_ELEMENT_ERROR (GST_ELEMENT (dts), STREAM, DECODE, (NULL),
+        ("Invalid channel flags: %d", job->flags));
+    return GST_FLOW_ERROR;
+  }
+
+  if (job->failed_block >= 0) {
+    /* also marks discont */
+    GST_AUDIO_DECODER_ERROR (dts, 1, STREAM, DECODE, (NULL),
+        ("error decoding block %d", job->failed_block), result);
+    if (result != GST_FLOW_OK)
+      return result;
+  }
+
+  block_bytes = 256 * chans * (dts->output_width / 8);
+  out = gst_dtsdownmix_output_reserve (dts, block_bytes * job->num_blocks,
+      &result);
+  if (!out)
+    return result;
+  for (i = 0; i < job->num_blocks; i++)
+    dts->interleave (out + i * block_bytes,
+        job->samples + i * 256 * chans, dts->channel_reorder_map, chans);
+
+  return gst_dtsdownmix_output_commit (dts, block_bytes * job->num_blocks,
+      256 * job->num_blocks);
+}
+
 static GstFlowReturn
 gst_dtsdownmix_handle_frame (GstAudioDecoder * bdec, GstBuffer * buffer)
 {
   GstDtsDec *dts;
-  gint channels, i, num_blocks;
-  gboolean need_renegotiation = FALSE;
+  gint i, num_blocks;
   guint8 *data;
   gsize size;
   GstMapInfo map;
   gint chans;
   gint length = 0, flags, sample_rate, bit_rate, frame_length;
   GstFlowReturn result = GST_FLOW_OK;
-  GstBuffer *outbuf;
+  GstDtsJob *job, *done;
   
   dts = GST_DTSDOWNMIX (bdec);
 
-  /* no fancy draining */
-  if (G_UNLIKELY (!buffer))
-    return GST_FLOW_OK;
+  /* drain what the decode thread and the aggregation hold back */
+  if (G_UNLIKELY (!buffer)) {
+    if (dts->worker && (done = gst_dtsdownmix_worker_wait (dts))) {
+      result = gst_dtsdownmix_finish_job (dts, done);
+      if (result != GST_FLOW_OK)
+        return result;
+    }
+    return gst_dtsdownmix_output_push (dts);
+  }
 
   /* parsed stuff already, so this should work out fine */
   gst_buffer_map (buffer, &map, GST_MAP_READ);
@@ -462,8 +1271,8 @@ gst_dtsdownmix_handle_frame (GstAudioDecoder * bdec, GstBuffer * buffer)
   bit_rate = dts->bit_rate;
   sample_rate = dts->sample_rate;
   flags = 0;
-  length = dca_syncinfo (dts->state, data, &flags, &sample_rate, &bit_rate,
-      &frame_length);
+  length = dca_syncinfo (dts->parse_state, data, &flags, &sample_rate,
+      &bit_rate, &frame_length);
   g_assert (length == size);
 
   if (flags != dts->prev_flags) {
@@ -471,11 +1280,8 @@ gst_dtsdownmix_handle_frame (GstAudioDecoder * bdec, GstBuffer * buffer)
     dts->flag_update = TRUE;
   }
 
-  /* go over stream properties, renegotiate or update streaminfo if needed */
-  if (dts->sample_rate != sample_rate) {
-    need_renegotiation = TRUE;
-    dts->sample_rate = sample_rate;
-  }
+  /* go over stream properties, update streaminfo if needed */
+  dts->sample_rate = sample_rate;
 
   if (flags) {
     dts->stream_channels = flags & (DCA_CHANNEL_MASK | DCA_LFE);
@@ -537,31 +1343,46 @@ gst_dtsdownmix_handle_frame (GstAudioDecoder * bdec, GstBuffer * buffer)
     flags = dts->using_channels;
   }
 
-  /* process */
   flags |= DCA_ADJUST_LEVEL;
+
+  if (dts->worker) {
+    gst_buffer_unmap (buffer, &map);
+
+    done = gst_dtsdownmix_worker_wait (dts);
+    job = &dts->jobs[dts->next_job];
+    dts->next_job ^= 1;
+    job->buffer = gst_buffer_ref (buffer);
+    job->sample_rate = sample_rate;
+    job->flags = flags;
+    job->drc = dts->dynamic_range_compression;
+    gst_dtsdownmix_worker_submit (dts, job);
+
+    /* push the previous frame while this one decodes */
+    if (done)
+      result = gst_dtsdownmix_finish_job (dts, done);
+    return result;
+  }
+
+  /* process */
   dts->level = 1;
   if (dca_frame (dts->state, data, &flags, &dts->level, dts->bias)) {
     gst_buffer_unmap (buffer, &map);
     GST_AUDIO_DECODER_ERROR (dts, 1, STREAM, DECODE, (NULL),
         ("dts_frame error"), result);
+    /* drop it, so the next frames keep their own timestamps */
+    if (result == GST_FLOW_OK)
+      result = gst_dtsdownmix_output_push (dts);
+    if (result == GST_FLOW_OK)
+      result = gst_audio_decoder_finish_frame (bdec, NULL, 1);
     goto exit;
   }
   gst_buffer_unmap (buffer, &map);
 
-  channels = flags & (DCA_CHANNEL_MASK | DCA_LFE);
-  if (dts->using_channels != channels) {
-    need_renegotiation = TRUE;
-    dts->using_channels = channels;
-  }
-
   /* negotiate if required */
-  if (need_renegotiation) {
-    GST_DEBUG_OBJECT (dts,
-        "dtsdownmix: sample_rate:%d stream_chans:0x%x using_chans:0x%x",
-        dts->sample_rate, dts->stream_channels, dts->using_channels);
-    if (!gst_dtsdownmix_renegotiate (dts))
-      goto failed_negotiation;
-  }
+  result = gst_dtsdownmix_update_output (dts,
+      flags & (DCA_CHANNEL_MASK | DCA_LFE), sample_rate);
+  if (result != GST_FLOW_OK)
+    goto exit;
 
   if (dts->dynamic_range_compression == FALSE) {
     dca_dynrng (dts->state, NULL, NULL);
@@ -574,12 +1395,10 @@ gst_dtsdownmix_handle_frame (GstAudioDecoder * bdec, GstBuffer * buffer)
 
   /* handle decoded data, one block is 256 samples */
   num_blocks = dca_blocks_num (dts->state);
-  outbuf =
-      gst_buffer_new_and_alloc (256 * chans * (SAMPLE_WIDTH / 8) * num_blocks);
-
-  gst_buffer_map (outbuf, &map, GST_MAP_WRITE);
-  data = map.data;
-  size = map.size;
+  size = 256 * chans * (dts->output_width / 8) * num_blocks;
+  data = gst_dtsdownmix_output_reserve (dts, size, &result);
+  if (!data)
+    goto exit;
   {
     guint8 *ptr = data;
     for (i = 0; i < num_blocks; i++) {
@@ -589,33 +1408,22 @@ gst_dtsdownmix_handle_frame (GstAudioDecoder * bdec, GstBuffer * buffer)
             ("error decoding block %d", i), result);
         if (result != GST_FLOW_OK)
           goto exit;
+        /* pooled buffers still hold an older frame, zero is silence in
+         * every output format */
+        memset (ptr, 0, 256 * chans * (dts->output_width / 8));
       } else {
-        gint n, c;
-        gint *reorder_map = dts->channel_reorder_map;
-
-        for (n = 0; n < 256; n++) {
-          for (c = 0; c < chans; c++) {
-            ((sample_t *) ptr)[n * chans + reorder_map[c]] =
-                dts->samples[c * 256 + n];
-          }
-        }
+        dts->interleave (ptr, dts->samples, dts->channel_reorder_map, chans);
       }
-      ptr += 256 * chans * (SAMPLE_WIDTH / 8);
+      ptr += 256 * chans * (dts->output_width / 8);
     }
   }
-  gst_buffer_unmap (outbuf, &map);
-  result = gst_audio_decoder_finish_frame (bdec, outbuf, 1);
+  result = gst_dtsdownmix_output_commit (dts, size, 256 * num_blocks);
 
 exit:
  // GST_INFO_OBJECT(dts,"STREAM IS RUNNING");
   return result;
 
   /* ERRORS */
-failed_negotiation:
-  {
-    GST_ELEMENT_ERROR (dts, CORE, NEGOTIATION, (NULL), (NULL));
-    return GST_FLOW_ERROR;
-  }
 invalid_flags:
   {
     GST_ELEMENT_ERROR (GST_ELEMENT (dts), STREAM, DECODE, (NULL),
@@ -736,6 +1544,15 @@ gst_dtsdownmix_set_property (GObject * object, guint prop_id, const GValue * val
     case PROP_DRC:
       dts->dynamic_range_compression = g_value_get_boolean (value);
       break;
+    case PROP_INTEGER_OUTPUT:
+      dts->integer_output = g_value_get_boolean (value);
+      break;
+    case PROP_THREADED_DECODE:
+      dts->threaded_decode = g_value_get_boolean (value);
+      break;
+    case PROP_FRAMES_PER_BUFFER:
+      dts->frames_per_buffer = g_value_get_uint (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -752,6 +1569,18 @@ gst_dtsdownmix_get_property (GObject * object, guint prop_id, GValue * value,
     case PROP_DRC:
       g_value_set_boolean (value, dts->dynamic_range_compression);
       break;
+    case PROP_INTEGER_OUTPUT:
+      g_value_set_boolean (value, dts->integer_output);
+      break;
+    case PROP_DECODE_PATH:
+      g_value_take_string (value, gst_dtsdownmix_describe_path (dts));
+      break;
+    case PROP_THREADED_DECODE:
+      g_value_set_boolean (value, dts->threaded_decode);
+      break;
+    case PROP_FRAMES_PER_BUFFER:
+      g_value_set_uint (value, dts->frames_per_buffer);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -771,6 +1600,8 @@ plugin_init (GstPlugin * plugin)
   if (!gst_element_register (plugin, "dtsdownmix", GST_RANK_PRIMARY,
           GST_TYPE_DTSDOWNMIX))
     return FALSE;
+  if (!gst_dvbdtsaudiosink_register (plugin))
+    return FALSE;
    return TRUE;
 }
 
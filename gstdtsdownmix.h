@@ -41,6 +41,26 @@ G_BEGIN_DECLS
 
 typedef struct _GstDtsDec GstDtsDec;
 typedef struct _GstDtsDecClass GstDtsDecClass;
+typedef struct _GstDtsJob GstDtsJob;
+
+/* interleaves one block of 256 planar samples per channel */
+typedef void (*GstDtsInterleaveFunc) (gpointer dst, const sample_t * src,
+    const gint * reorder_map, gint chans);
+
+/* one frame handed to the decode thread */
+struct _GstDtsJob {
+	GstBuffer *buffer;
+	gint sample_rate;
+	gint flags;
+	gboolean drc;
+
+	/* filled in by the decode thread */
+	gboolean failed;
+	gint failed_block;
+	gint num_blocks;
+	sample_t *samples;
+	gsize samples_size;
+};
 
 struct _GstDtsDec {
 	GstAudioDecoder	 element;
@@ -64,8 +84,14 @@ struct _GstDtsDec {
 	gint 	         stream_channels;
 	gint 	         request_channels;
 	gint 	         using_channels;
+	gint 	         output_rate;
+	gint 	         sync_length;
 
-	gint           channel_reorder_map[6];
+	gint           channel_reorder_map[7];
+	GstDtsInterleaveFunc interleave;
+	gboolean integer_output;
+	GstAudioFormat output_format;
+	gint output_width;
 
 	/* decoding properties */
 	sample_t 	 level;
@@ -73,6 +99,31 @@ struct _GstDtsDec {
 	gboolean 	 dynamic_range_compression;
 	sample_t 	*samples;
 	dca_state_t   *state;
+	/* syncinfo only, so parse never touches the state being decoded */
+	dca_state_t   *parse_state;
+
+	/* decode thread: frame N+1 decodes while frame N is pushed */
+	gboolean threaded_decode;
+	GThread *worker;
+	GMutex worker_lock;
+	GCond worker_cond;
+	gboolean worker_quit;
+	GstDtsJob *worker_job;
+	GstDtsJob *worker_done;
+	GstDtsJob jobs[2];
+	gint next_job;
+
+	/* frames decoded into out_pending, see frames-per-buffer */
+	guint frames_per_buffer;
+	GstBuffer *out_pending;
+	GstMapInfo out_map;
+	gsize out_fill;
+	gint out_frames;
+	gboolean latency_set;
+
+	/* from decide_allocation, buffers of pool_size bytes */
+	GstBufferPool *pool;
+	guint pool_size;
 };
 
 struct _GstDtsDecClass {
@@ -71,6 +71,7 @@
 #include <gst/gst.h>
 #include <gst/audio/audio.h>
 #include <gst/base/gstbasesink.h>
+#include <gst/base/gstadapter.h>
 #include <gst/audio/gstaudiodecoder.h>
 
 #include "common.h"
@@ -80,10 +81,129 @@
 GST_DEBUG_CATEGORY_STATIC(dvbaudiosink_debug);
 #define GST_CAT_DEFAULT dvbaudiosink_debug
 
+#define PCM_BLOCK_TIME_DEFAULT (30 * GST_MSECOND)
+/* limits and window of the automatic pcm block time (pcm-block-time=0) */
+#define PCM_AUTO_BLOCK_TIME_MIN (2 * GST_MSECOND)
+#define PCM_AUTO_BLOCK_TIME_MAX (100 * GST_MSECOND)
+#define PCM_AUTO_WINDOW 50
+
+/* default byte limit of an aggregated pes packet (aggregate-time > 0) */
+#define AUDIO_AGGREGATE_SIZE_DEFAULT 8192
+/* stays clear of the 16 bit pes packet length */
+#define AUDIO_AGGREGATE_SIZE_MAX 60000
+/* rounding slack of frame timestamps which still continue the aggregate */
+#define AUDIO_AGGREGATE_JITTER GST_MSECOND
+
+
+/* conversions to the native pcm the decoder takes, done while packetizing */
+enum
+{
+	PCM_CONVERT_NONE,
+	PCM_CONVERT_SWAP16,
+	PCM_CONVERT_SWAP24,
+	PCM_CONVERT_SWAP32,
+	PCM_CONVERT_F32,
+	PCM_CONVERT_F32_SWAP,
+	PCM_CONVERT_F64,
+	PCM_CONVERT_F64_SWAP,
+};
+
+#if defined(DREAMBOX) || defined(MAX_PCMRATE_48K)
+/* higher rates are decimated in the sink, see gst_dvbaudiosink_resample_pcm() */
+#define PCM_MAX_RATE 48000
+#endif
+
+#ifdef PCM_MAX_RATE
+/*
+ * Kaiser windowed sinc lowpass filters (beta 7, cutoff at 90% of the output
+ * nyquist frequency) in Q15, for decimation by 2 and by 4.
+ */
+static const gint16 pcm_decimate2_taps[] =
+{
+	0, 14, 8, -58, -58, 139, 217, -224, -575, 207, 1242, 138, -2452, -1467, 5751, 13502,
+	13502, 5751, -1467, -2452, 138, 1242, 207, -575, -224, 217, 139, -58, -58, 8, 14, 0
+};
+
+static const gint16 pcm_decimate4_taps[] =
+{
+	-1, 2, 6, 10, 9, -3, -22, -40, -42, -13, 42, 102, 127, 81, -39, -191,
+	-292, -256, -49, 273, 559, 623, 340, -262, -960, -1386, -1165, -85, 1772, 4009, 6022, 7213,
+	7213, 6022, 4009, 1772, -85, -1165, -1386, -960, -262, 340, 623, 559, 273, -49, -256, -292,
+	-191, -39, 81, 127, 102, 42, -13, -42, -40, -22, -3, 9, 10, 6, 2, -1
+};
+
+static inline gint64 pcm_decimate_sample(const gint32 *window, const gint16 *coeffs, int taps, int stride)
+{
+	gint64 acc = 1 << 14;
+	int k;
+	for (k = 0; k < taps; k++)
+	{
+		acc += (gint64)coeffs[k] * window[k * stride];
+	}
+	return acc >> 15;
+}
+#endif
+
+/*
+ * Downmix to stereo with the ITU-R BS.775 coefficients in Q14, the lfe is
+ * dropped. Channels are interleaved in gstreamer order, i.e. by ascending
+ * position bit of the channel-mask.
+ */
+#define PCM_DOWNMIX_UNITY 16384
+#define PCM_DOWNMIX_M3DB 11585
+#define PCM_DOWNMIX_M6DB 8192
+
+#define PCM_MASK_5_1 0x3f
+#define PCM_MASK_7_1 0xc3f
+
+/* FL FR FC LFE RL RR */
+static const gint16 pcm_downmix_5_1_left[] = { PCM_DOWNMIX_UNITY, 0, PCM_DOWNMIX_M3DB, 0, PCM_DOWNMIX_M3DB, 0 };
+static const gint16 pcm_downmix_5_1_right[] = { 0, PCM_DOWNMIX_UNITY, PCM_DOWNMIX_M3DB, 0, 0, PCM_DOWNMIX_M3DB };
+/* FL FR FC LFE RL RR SL SR */
+static const gint16 pcm_downmix_7_1_left[] = { PCM_DOWNMIX_UNITY, 0, PCM_DOWNMIX_M3DB, 0, PCM_DOWNMIX_M3DB, 0, PCM_DOWNMIX_M3DB, 0 };
+static const gint16 pcm_downmix_7_1_right[] = { 0, PCM_DOWNMIX_UNITY, PCM_DOWNMIX_M3DB, 0, 0, PCM_DOWNMIX_M3DB, 0, PCM_DOWNMIX_M3DB };
+
+/*
+ * With a constant channel count and coefficient table the inner loop
+ * unrolls and the kernel specializes per layout.
+ */
+#define PCM_DOWNMIX_KERNEL(name, type, acc_type, min, max) \
+static inline void name(type *dst, const type *src, gsize frames, int channels, const gint16 *left, const gint16 *right) \
+{ \
+	gsize i; \
+	int c; \
+	for (i = 0; i < frames; i++, src += channels) \
+	{ \
+		acc_type l = 1 << 13, r = 1 << 13; \
+		for (c = 0; c < channels; c++) \
+		{ \
+			l += (acc_type)left[c] * src[c]; \
+			r += (acc_type)right[c] * src[c]; \
+		} \
+		l >>= 14; \
+		r >>= 14; \
+		dst[2 * i] = CLAMP(l, min, max); \
+		dst[2 * i + 1] = CLAMP(r, min, max); \
+	} \
+}
+
+/* the s16 accumulator holds as long as the coefficients of one output sum up to less than 4.0 */
+PCM_DOWNMIX_KERNEL(pcm_downmix_s16, gint16, gint32, G_MININT16, G_MAXINT16)
+PCM_DOWNMIX_KERNEL(pcm_downmix_s32, gint32, gint64, G_MININT32, G_MAXINT32)
+
 enum
 {
 	PROP_0,
 	PROP_SYNC,
+	PROP_KEEP_DEVICE_OPEN,
+	PROP_ADAPTER,
+	PROP_DECODER,
+	PROP_VIDEO_DECODER,
+	PROP_PCM_BLOCK_TIME,
+	PROP_AGGREGATE_TIME,
+	PROP_AGGREGATE_SIZE,
+	PROP_LEAD_HIGH_WATERMARK,
+	PROP_LEAD_LOW_WATERMARK,
 	PROP_LAST,
 };
 
@@ -153,18 +273,33 @@ static guint gst_dvbaudiosink_signals[LAST_SIGNAL] = { 0 };
 		"rate = (int) {8000, 16000}, channels = (int) 1; "
 
 #define XRAW "audio/x-raw"
+/* formats the sink can downmix, decimate or both */
+#define PCMINTFORMATS \
+		"format = (string) { "GST_AUDIO_NE(S32)", "GST_AUDIO_NE(S16)", "GST_AUDIO_OE(S32)", "GST_AUDIO_OE(S16)", F32LE, F32BE, F64LE, F64BE }, "
 #if defined(DREAMBOX) || defined(MAX_PCMRATE_48K)
 #define PCMCAPS \
 		"audio/x-raw, " \
-		"format = (string) { "GST_AUDIO_NE(S32)", "GST_AUDIO_NE(S24)", "GST_AUDIO_NE(S16)", S8, "GST_AUDIO_NE(U32)", "GST_AUDIO_NE(U24)", "GST_AUDIO_NE(U16)", U8 }, " \
+		"format = (string) { "GST_AUDIO_NE(S32)", "GST_AUDIO_NE(S24)", "GST_AUDIO_NE(S16)", S8, "GST_AUDIO_NE(U32)", "GST_AUDIO_NE(U24)", "GST_AUDIO_NE(U16)", U8, "GST_AUDIO_OE(S32)", "GST_AUDIO_OE(S24)", "GST_AUDIO_OE(S16)", F32LE, F32BE, F64LE, F64BE }, " \
 		"layout = (string) { interleaved, non-interleaved }, " \
-		"rate = (int) [ 1, 48000 ], " "channels = (int) [ 1, 2 ]; "
+		"rate = (int) [ 1, 48000 ], " "channels = (int) [ 1, 2 ]; " \
+		"audio/x-raw, " \
+		PCMINTFORMATS \
+		"layout = (string) interleaved, " \
+		"rate = (int) [ 1, 48000 ], " "channels = (int) [ 3, 8 ]; " \
+		"audio/x-raw, " \
+		PCMINTFORMATS \
+		"layout = (string) interleaved, " \
+		"rate = (int) { 88200, 96000, 176400, 192000 }, " "channels = (int) [ 1, 8 ]; "
 #else
 #define PCMCAPS \
 		"audio/x-raw, " \
-		"format = (string) { "GST_AUDIO_NE(S32)", "GST_AUDIO_NE(S24)", "GST_AUDIO_NE(S16)", S8, "GST_AUDIO_NE(U32)", "GST_AUDIO_NE(U24)", "GST_AUDIO_NE(U16)", U8 }, " \
+		"format = (string) { "GST_AUDIO_NE(S32)", "GST_AUDIO_NE(S24)", "GST_AUDIO_NE(S16)", S8, "GST_AUDIO_NE(U32)", "GST_AUDIO_NE(U24)", "GST_AUDIO_NE(U16)", U8, "GST_AUDIO_OE(S32)", "GST_AUDIO_OE(S24)", "GST_AUDIO_OE(S16)", F32LE, F32BE, F64LE, F64BE }, " \
 		"layout = (string) { interleaved, non-interleaved }, " \
-		"rate = (int) [ 1, MAX ], " "channels = (int) [ 1, 2 ]; "
+		"rate = (int) [ 1, MAX ], " "channels = (int) [ 1, 2 ]; " \
+		"audio/x-raw, " \
+		PCMINTFORMATS \
+		"layout = (string) interleaved, " \
+		"rate = (int) [ 1, MAX ], " "channels = (int) [ 3, 8 ]; "
 #endif
 
 static GstStaticPadTemplate sink_factory =
@@ -242,6 +377,12 @@ static gboolean gst_dvbaudiosink_start(GstBaseSink * sink);
 static gboolean gst_dvbaudiosink_stop(GstBaseSink * sink);
 static gboolean gst_dvbaudiosink_event(GstBaseSink * sink, GstEvent * event);
 static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink * sink, GstBuffer * buffer);
+static GstFlowReturn gst_dvbaudiosink_render_list(GstBaseSink * sink, GstBufferList * list);
+static GstFlowReturn gst_dvbaudiosink_prepare(GstBaseSink * sink, GstBuffer * buffer);
+static GstFlowReturn gst_dvbaudiosink_prepare_list(GstBaseSink * sink, GstBufferList * list);
+static void audio_prepared_drop(GstDVBAudioSink *self);
+static GstFlowReturn gst_dvbaudiosink_aggregate_flush(GstDVBAudioSink *self);
+static void gst_dvbaudiosink_aggregate_drain(GstDVBAudioSink *self, gboolean eos);
 static gboolean gst_dvbaudiosink_unlock(GstBaseSink * basesink);
 static gboolean gst_dvbaudiosink_unlock_stop(GstBaseSink * basesink);
 static gboolean gst_dvbaudiosink_set_caps(GstBaseSink * sink, GstCaps * caps);
@@ -275,9 +416,53 @@ static void gst_dvbaudiosink_class_init(GstDVBAudioSinkClass *self)
 			g_param_spec_boolean ("sync", "Sync", "Sync on the clock", FALSE,
 					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+	g_object_class_install_property (gobject_class, PROP_KEEP_DEVICE_OPEN,
+			g_param_spec_boolean ("keep-device-open", "Keep device open", "Keep the decoder open for a short while after stop, so the next sink can reuse it", FALSE,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_ADAPTER,
+			g_param_spec_int ("adapter", "Adapter", "Index of the dvb adapter, used when the sink is started", 0, 255, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_DECODER,
+			g_param_spec_int ("decoder", "Decoder", "Index of the audio decoder, used when the sink is started", 0, 255, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_VIDEO_DECODER,
+			g_param_spec_int ("video-decoder", "Video decoder", "Index of the video decoder playing along, its rate is changed for trick modes", 0, 255, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_PCM_BLOCK_TIME,
+			g_param_spec_uint64 ("pcm-block-time", "PCM block time", "Duration of the raw pcm blocks written to the decoder in nanoseconds, 0 picks the smallest one the decoder sustains (applied on the next caps)",
+					0, GST_SECOND, PCM_BLOCK_TIME_DEFAULT,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_AGGREGATE_TIME,
+			g_param_spec_uint64 ("aggregate-time", "Aggregate time", "Pack consecutive compressed audio frames (mpeg, aac, ac3) into one pes packet covering up to this many nanoseconds, 0 writes every frame as a packet of its own",
+					0, GST_SECOND, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_AGGREGATE_SIZE,
+			g_param_spec_uint ("aggregate-size", "Aggregate size", "Maximum payload of an aggregated pes packet in bytes",
+					512, AUDIO_AGGREGATE_SIZE_MAX, AUDIO_AGGREGATE_SIZE_DEFAULT,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_LEAD_HIGH_WATERMARK,
+			g_param_spec_uint64 ("lead-high-watermark", "Lead high watermark", "Never write data more than this many nanoseconds ahead of the decoder pts, which bounds what a flush throws away, 0 is no limit",
+					0, 10 * GST_SECOND, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_LEAD_LOW_WATERMARK,
+			g_param_spec_uint64 ("lead-low-watermark", "Lead low watermark", "Post buffering messages while the data written is less than this many nanoseconds ahead of the decoder pts, 0 posts none",
+					0, 10 * GST_SECOND, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
 	gstbasesink_class->start = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_start);
 	gstbasesink_class->stop = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_stop);
 	gstbasesink_class->render = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_render);
+	gstbasesink_class->render_list = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_render_list);
+	gstbasesink_class->prepare = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_prepare);
+	gstbasesink_class->prepare_list = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_prepare_list);
 	gstbasesink_class->event = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_event);
 	gstbasesink_class->unlock = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_unlock);
 	gstbasesink_class->unlock_stop = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_unlock_stop);
@@ -305,21 +490,77 @@ static void gst_dvbaudiosink_init(GstDVBAudioSink *self)
 {
 	self->codec_data = NULL;
 	self->bypass = AUDIOTYPE_UNKNOWN;
+	self->reclaimed_bypass = -1;
 	self->fixed_buffersize = 0;
-	self->fixed_bufferduration = GST_CLOCK_TIME_NONE;
-	self->fixed_buffertimestamp = GST_CLOCK_TIME_NONE;
+	self->pcm_rate = self->pcm_frame_size = 0;
+	self->pcm_timestamp = GST_CLOCK_TIME_NONE;
+	self->pcm_samples = 0;
+	self->pcm_convert = PCM_CONVERT_NONE;
+	self->pcm_convert_buffer = NULL;
+	self->pcm_channels = self->pcm_width = 0;
+	self->pcm_resample_factor = 1;
+	self->pcm_resample_work = NULL;
+	self->pcm_resample_history = self->pcm_resample_work_size = 0;
+	self->pcm_resample_buffer = NULL;
+	self->pcm_downmix_channels = 0;
+	self->pcm_downmix_mask = 0;
+	self->pcm_downmix_buffer = NULL;
+	self->pcm_block_time = PCM_BLOCK_TIME_DEFAULT;
+	self->pcm_auto_block_time = PCM_BLOCK_TIME_DEFAULT;
+	self->pcm_auto_blocks = 0;
+	self->pcm_written_end = GST_CLOCK_TIME_NONE;
+	self->pcm_written_blocks = 0;
+	self->poll_wait = 0;
+	self->aggregate = NULL;
+	self->aggregate_pts = GST_CLOCK_TIME_NONE;
+	self->aggregate_end = GST_CLOCK_TIME_NONE;
+	self->aggregate_time = 0;
+	self->aggregate_size = AUDIO_AGGREGATE_SIZE_DEFAULT;
+	self->gather_pts = GST_CLOCK_TIME_NONE;
+	self->lead_high_watermark = self->lead_low_watermark = 0;
 	self->aac_adts_header_valid = FALSE;
 	self->pesheader_buffer = NULL;
-	self->cache = NULL;
+	self->pcm_adapter = NULL;
 	self->playing = self->flushing = self->unlocking = self->paused = self->first_paused = FALSE;
 	self->pts_written = self->using_dts_downmix = self->first_paused = FALSE;
 	self->lastpts = 0;
 	self->timestamp_offset = 0;
 	self->queue = NULL;
+	self->io.element = GST_ELEMENT(self);
+	self->io.category = GST_CAT_DEFAULT;
+	self->io.fd = &self->fd;
+	self->io.unlockfd = &self->unlockfd[0];
+	self->io.get_pts = AUDIO_GET_PTS;
+	self->io.events = 0;
+	self->io.handle_event = NULL;
+#if defined(__sh__) && !defined(CHECK_DRAIN)
+	self->io.skip_poll = TRUE;
+#else
+	self->io.skip_poll = FALSE;
+#endif
+	self->io.playing = &self->playing;
+	self->io.paused = &self->paused;
+	self->io.flushing = &self->flushing;
+	self->io.unlocking = &self->unlocking;
+	self->io.pts_written = &self->pts_written;
+	self->io.rate = &self->rate;
+	self->io.queue = &self->queue;
+	self->io.buffering_percent = 100;
+	self->io.poll_wait = &self->poll_wait;
+	self->gathering = FALSE;
+	self->gather_spans = NULL;
+	self->gather_headers = NULL;
+	self->write_spans = NULL;
+	self->write_headers = NULL;
+	self->prepared = NULL;
+	self->prepared_pts_written = FALSE;
+	self->device = NULL;
 	self->fd = -1;
 	self->unlockfd[0] = self->unlockfd[1] = -1;
 	self->rate = 1.0;
 	self->timestamp = GST_CLOCK_TIME_NONE;
+	self->keep_device_open = FALSE;
+	self->adapter = self->decoder = self->video_decoder = 0;
 #ifdef AUDIO_SET_ENCODING
 	self->use_set_encoding = TRUE;
 #else
@@ -356,6 +597,33 @@ static void gst_dvbaudiosink_set_property (GObject * object, guint prop_id, cons
 	case PROP_SYNC:
 		GST_INFO_OBJECT(self, "ignoring attempt to change 'sync' to '%d'", g_value_get_boolean(value));
 		break;
+	case PROP_KEEP_DEVICE_OPEN:
+		self->keep_device_open = g_value_get_boolean(value);
+		break;
+	case PROP_ADAPTER:
+		self->adapter = g_value_get_int(value);
+		break;
+	case PROP_DECODER:
+		self->decoder = g_value_get_int(value);
+		break;
+	case PROP_VIDEO_DECODER:
+		self->video_decoder = g_value_get_int(value);
+		break;
+	case PROP_PCM_BLOCK_TIME:
+		self->pcm_block_time = g_value_get_uint64(value);
+		break;
+	case PROP_AGGREGATE_TIME:
+		self->aggregate_time = g_value_get_uint64(value);
+		break;
+	case PROP_AGGREGATE_SIZE:
+		self->aggregate_size = g_value_get_uint(value);
+		break;
+	case PROP_LEAD_HIGH_WATERMARK:
+		self->lead_high_watermark = g_value_get_uint64(value);
+		break;
+	case PROP_LEAD_LOW_WATERMARK:
+		self->lead_low_watermark = g_value_get_uint64(value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -372,6 +640,33 @@ static void gst_dvbaudiosink_get_property (GObject * object, guint prop_id, GVal
 	case PROP_SYNC:
 		g_value_set_boolean(value, gst_base_sink_get_sync(GST_BASE_SINK(object)));
 		break;
+	case PROP_KEEP_DEVICE_OPEN:
+		g_value_set_boolean(value, self->keep_device_open);
+		break;
+	case PROP_ADAPTER:
+		g_value_set_int(value, self->adapter);
+		break;
+	case PROP_DECODER:
+		g_value_set_int(value, self->decoder);
+		break;
+	case PROP_VIDEO_DECODER:
+		g_value_set_int(value, self->video_decoder);
+		break;
+	case PROP_PCM_BLOCK_TIME:
+		g_value_set_uint64(value, self->pcm_block_time);
+		break;
+	case PROP_AGGREGATE_TIME:
+		g_value_set_uint64(value, self->aggregate_time);
+		break;
+	case PROP_AGGREGATE_SIZE:
+		g_value_set_uint(value, self->aggregate_size);
+		break;
+	case PROP_LEAD_HIGH_WATERMARK:
+		g_value_set_uint64(value, self->lead_high_watermark);
+		break;
+	case PROP_LEAD_LOW_WATERMARK:
+		g_value_set_uint64(value, self->lead_low_watermark);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -398,6 +693,59 @@ static gint64 gst_dvbaudiosink_get_decoder_time(GstDVBAudioSink *self)
 	return cur;
 }
 
+static void gst_dvbaudiosink_set_pcm_block_time(GstDVBAudioSink *self, GstClockTime block_time)
+{
+	int frames = gst_util_uint64_scale_int(block_time, self->pcm_rate, GST_SECOND);
+	/* the resampler wants whole output frames per block */
+	frames = (MAX(frames, 1) + self->pcm_resample_factor - 1) / self->pcm_resample_factor * self->pcm_resample_factor;
+	self->fixed_buffersize = frames * self->pcm_frame_size;
+	GST_DEBUG_OBJECT(self, "pcm block time %" GST_TIME_FORMAT ", %d bytes", GST_TIME_ARGS(block_time), self->fixed_buffersize);
+}
+
+/*
+ * Automatic pcm block time: grow the blocks right away when the decoder lead
+ * drops below a few blocks, shrink them after a window of blocks during which
+ * the lead stayed healthy and the writer mostly waited for room in the decoder.
+ * The lead is sampled once per write, after the blocks went to the decoder.
+ */
+static void gst_dvbaudiosink_tune_pcm_block_time(GstDVBAudioSink *self)
+{
+	gint64 pts = 0;
+	GstClockTime block_time = self->pcm_auto_block_time;
+	GstClockTime end = self->pcm_written_end;
+	guint blocks = self->pcm_written_blocks;
+	gint64 lead;
+
+	self->pcm_written_end = GST_CLOCK_TIME_NONE;
+	self->pcm_written_blocks = 0;
+	if (self->pcm_block_time || end == GST_CLOCK_TIME_NONE || ioctl(self->fd, AUDIO_GET_PTS, &pts) < 0 || !pts) return;
+
+	lead = MAX(pes_pts_lead(end, pts), 0);
+	if (lead < 3 * (gint64)block_time)
+	{
+		block_time = MIN(block_time * 2, PCM_AUTO_BLOCK_TIME_MAX);
+		self->pcm_auto_blocks = 0;
+		self->poll_wait = 0;
+	}
+	else if ((self->pcm_auto_blocks += blocks) >= PCM_AUTO_WINDOW)
+	{
+		/* poll_wait is in microseconds */
+		if ((GstClockTime)self->poll_wait * GST_USECOND > PCM_AUTO_WINDOW * block_time / 2)
+		{
+			block_time = MAX(block_time * 3 / 4, PCM_AUTO_BLOCK_TIME_MIN);
+		}
+		self->pcm_auto_blocks = 0;
+		self->poll_wait = 0;
+	}
+
+	if (block_time != self->pcm_auto_block_time)
+	{
+		GST_INFO_OBJECT(self, "decoder lead %" GST_TIME_FORMAT ", switching to %" GST_TIME_FORMAT " pcm blocks", GST_TIME_ARGS(lead), GST_TIME_ARGS(block_time));
+		self->pcm_auto_block_time = block_time;
+		gst_dvbaudiosink_set_pcm_block_time(self, block_time);
+	}
+}
+
 static gboolean gst_dvbaudiosink_unlock(GstBaseSink *basesink)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK(basesink);
@@ -465,6 +813,73 @@ static GstCaps *gst_dvbaudiosink_get_caps(GstBaseSink *basesink, GstCaps *filter
 	return caps;
 }
 
+static void gst_dvbaudiosink_setup_downmix(GstDVBAudioSink *self, GstStructure *structure, int channels)
+{
+	/* gstreamer's fallback positions, used when the caps don't carry a channel-mask */
+	static const guint64 fallback_masks[] = { 0, 0x4, 0x3, 0xb, 0x33, 0x37, 0x3f, 0x13f, 0xc3f };
+	guint64 mask = 0;
+	int left_sum = 0, right_sum = 0;
+	int position, c = 0;
+
+	if (!gst_structure_get(structure, "channel-mask", GST_TYPE_BITMASK, &mask, NULL) || !mask)
+	{
+		mask = fallback_masks[channels];
+	}
+
+	memset(self->pcm_downmix_left, 0, sizeof(self->pcm_downmix_left));
+	memset(self->pcm_downmix_right, 0, sizeof(self->pcm_downmix_right));
+	for (position = 0; position < 64 && c < channels; position++)
+	{
+		if (!(mask & ((guint64)1 << position))) continue;
+		switch (position)
+		{
+		case 0: /* front left */
+		case 6: /* front left of center */
+			self->pcm_downmix_left[c] = PCM_DOWNMIX_UNITY;
+			break;
+		case 1: /* front right */
+		case 7: /* front right of center */
+			self->pcm_downmix_right[c] = PCM_DOWNMIX_UNITY;
+			break;
+		case 2: /* front center */
+			self->pcm_downmix_left[c] = self->pcm_downmix_right[c] = PCM_DOWNMIX_M3DB;
+			break;
+		case 3: /* lfe */
+		case 9:
+			break;
+		case 4: /* rear left */
+		case 10: /* side left */
+			self->pcm_downmix_left[c] = PCM_DOWNMIX_M3DB;
+			break;
+		case 5: /* rear right */
+		case 11: /* side right */
+			self->pcm_downmix_right[c] = PCM_DOWNMIX_M3DB;
+			break;
+		default: /* rear center and the more exotic ones */
+			self->pcm_downmix_left[c] = self->pcm_downmix_right[c] = PCM_DOWNMIX_M6DB;
+			break;
+		}
+		left_sum += self->pcm_downmix_left[c];
+		right_sum += self->pcm_downmix_right[c];
+		c++;
+	}
+
+	/* keep the s16 accumulator from overflowing on unusual layouts */
+	if (MAX(left_sum, right_sum) >= 4 * PCM_DOWNMIX_UNITY)
+	{
+		int sum = MAX(left_sum, right_sum);
+		for (c = 0; c < channels; c++)
+		{
+			self->pcm_downmix_left[c] = self->pcm_downmix_left[c] * 3 * PCM_DOWNMIX_UNITY / sum;
+			self->pcm_downmix_right[c] = self->pcm_downmix_right[c] * 3 * PCM_DOWNMIX_UNITY / sum;
+		}
+	}
+
+	self->pcm_downmix_channels = channels;
+	self->pcm_downmix_mask = mask;
+	GST_INFO_OBJECT(self, "downmixing %d channels (mask 0x%" G_GINT64_MODIFIER "x) to stereo", channels, mask);
+}
+
 static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK(basesink);
@@ -472,8 +887,15 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 	const char *type = gst_structure_get_name(structure);
 	t_audio_type bypass = AUDIOTYPE_UNKNOWN;
 
+	/* frames of the previous format go out before the decoder is reconfigured */
+	gst_dvbaudiosink_aggregate_drain(self, FALSE);
 	self->skip = 0;
 	self->aac_adts_header_valid = FALSE;
+	self->fixed_buffersize = 0;
+	self->pcm_convert = PCM_CONVERT_NONE;
+	self->pcm_resample_factor = 1;
+	self->pcm_downmix_channels = 0;
+	if (self->pcm_adapter) gst_adapter_clear(self->pcm_adapter);
 
 	GST_INFO_OBJECT (self, "caps = %" GST_PTR_FORMAT, caps);
 
@@ -704,6 +1126,7 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 		gint format = 0x01;
 		const gchar *formatstring = NULL;
 		gint width = 0, depth = 0, rate = 0, channels, block_align, byterate;
+		gint input_width = 0, input_channels, output_rate;
 		self->codec_data = gst_buffer_new_and_alloc(18);
 		GstMapInfo map;
 		gst_buffer_map(self->codec_data, &map, GST_MAP_WRITE);
@@ -712,7 +1135,23 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 		formatstring = gst_structure_get_string(structure, "format");
 		if (formatstring)
 		{
-			if (!strncmp(&formatstring[1], "32", 2))
+			size_t length = strlen(formatstring);
+			gboolean swap = length > 2 && !strcmp(&formatstring[length - 2], G_BYTE_ORDER == G_LITTLE_ENDIAN ? "BE" : "LE");
+			if (formatstring[0] == 'F')
+			{
+				/* float goes to the decoder as native S32 */
+				width = depth = 32;
+				input_width = strncmp(&formatstring[1], "64", 2) ? 32 : 64;
+				if (input_width == 64)
+				{
+					self->pcm_convert = swap ? PCM_CONVERT_F64_SWAP : PCM_CONVERT_F64;
+				}
+				else
+				{
+					self->pcm_convert = swap ? PCM_CONVERT_F32_SWAP : PCM_CONVERT_F32;
+				}
+			}
+			else if (!strncmp(&formatstring[1], "32", 2))
 			{
 				width = depth = 32;
 			}
@@ -728,10 +1167,53 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 			{
 				width = depth = 8;
 			}
+			if (formatstring[0] != 'F')
+			{
+				input_width = width;
+				if (swap)
+				{
+					self->pcm_convert = width == 32 ? PCM_CONVERT_SWAP32 : width == 24 ? PCM_CONVERT_SWAP24 : PCM_CONVERT_SWAP16;
+				}
+			}
 		}
 		gst_structure_get_int(structure, "rate", &rate);
 		gst_structure_get_int(structure, "channels", &channels);
-		byterate = channels * rate * width / 8;
+		input_channels = channels;
+		if (channels > 2)
+		{
+			/* the caps only let s16 and s32 (after conversion) through with more than two channels */
+			if (width != 16 && width != 32)
+			{
+				GST_ELEMENT_ERROR(self, STREAM, FORMAT, (NULL), ("can't downmix %s", formatstring));
+				gst_buffer_unmap(self->codec_data, &map);
+				return FALSE;
+			}
+			gst_dvbaudiosink_setup_downmix(self, structure, channels);
+			channels = 2;
+		}
+		output_rate = rate;
+#ifdef PCM_MAX_RATE
+		if (rate > PCM_MAX_RATE)
+		{
+			/* the caps only let 88.2, 96, 176.4 and 192 kHz through above the limit */
+			int taps;
+			self->pcm_resample_factor = rate / (rate % 44100 ? 48000 : 44100);
+			output_rate = rate / self->pcm_resample_factor;
+			if ((self->pcm_resample_factor != 2 && self->pcm_resample_factor != 4) || (width != 16 && width != 32))
+			{
+				GST_ELEMENT_ERROR(self, STREAM, FORMAT, (NULL), ("can't resample %s at %d Hz", formatstring, rate));
+				gst_buffer_unmap(self->codec_data, &map);
+				return FALSE;
+			}
+			taps = self->pcm_resample_factor == 2 ? G_N_ELEMENTS(pcm_decimate2_taps) : G_N_ELEMENTS(pcm_decimate4_taps);
+			self->pcm_resample_history = (taps - 1) * channels;
+			self->pcm_resample_work_size = self->pcm_resample_history;
+			g_free(self->pcm_resample_work);
+			self->pcm_resample_work = g_malloc0(self->pcm_resample_work_size * sizeof(gint32));
+			GST_INFO_OBJECT(self, "resampling %d Hz to %d Hz", rate, output_rate);
+		}
+#endif
+		byterate = channels * output_rate * width / 8;
 		block_align = channels * width / 8;
 		memset(data, 0, size);
 		/* format tag */
@@ -741,10 +1223,10 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 		*(data++) = channels & 0xff;
 		*(data++) = (channels >> 8) & 0xff;
 		/* sample rate */
-		*(data++) = rate & 0xff;
-		*(data++) = (rate >> 8) & 0xff;
-		*(data++) = (rate >> 16) & 0xff;
-		*(data++) = (rate >> 24) & 0xff;
+		*(data++) = output_rate & 0xff;
+		*(data++) = (output_rate >> 8) & 0xff;
+		*(data++) = (output_rate >> 16) & 0xff;
+		*(data++) = (output_rate >> 24) & 0xff;
 		/* byte rate */
 		*(data++) = byterate & 0xff;
 		*(data++) = (byterate >> 8) & 0xff;
@@ -756,11 +1238,28 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 		/* word size */
 		*(data++) = depth & 0xff;
 		*(data++) = (depth >> 8) & 0xff;
-		self->fixed_buffersize = rate * 30 / 1000;
-		self->fixed_buffersize *= channels * depth / 8;
-		self->fixed_buffertimestamp = GST_CLOCK_TIME_NONE;
-		self->fixed_bufferduration = GST_SECOND * (GstClockTime)self->fixed_buffersize / (GstClockTime)byterate;
-		GST_INFO_OBJECT(self, "MIMETYPE %s", type);
+		self->pcm_rate = rate;
+		self->pcm_channels = channels;
+		self->pcm_width = width;
+		/* blocks are cut from the input, before any conversion */
+		self->pcm_frame_size = input_channels * input_width / 8;
+		if (self->pcm_block_time)
+		{
+			gst_dvbaudiosink_set_pcm_block_time(self, self->pcm_block_time);
+		}
+		else
+		{
+			/* auto mode starts from the default and adapts while playing */
+			self->pcm_auto_block_time = PCM_BLOCK_TIME_DEFAULT;
+			self->pcm_auto_blocks = 0;
+			self->poll_wait = 0;
+			gst_dvbaudiosink_set_pcm_block_time(self, self->pcm_auto_block_time);
+		}
+		self->pcm_timestamp = GST_CLOCK_TIME_NONE;
+		self->pcm_samples = 0;
+		self->pcm_written_end = GST_CLOCK_TIME_NONE;
+		self->pcm_written_blocks = 0;
+		GST_INFO_OBJECT(self, "MIMETYPE %s, format %s, conversion %d", type, formatstring, self->pcm_convert);
 		bypass = AUDIOTYPE_RAW;
 		gst_buffer_unmap(self->codec_data, &map);
 	}
@@ -772,6 +1271,15 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 
 	GST_INFO_OBJECT(self, "set bypass 0x%02x", bypass);
 
+	if (self->playing && bypass == self->reclaimed_bypass)
+	{
+		/* the reclaimed decoder is still running this format */
+		self->reclaimed_bypass = -1;
+		self->bypass = bypass;
+		GST_INFO_OBJECT(self, "AUDIO PLAY CONTINUED ON BY-PASS 0x%02x", bypass);
+		return TRUE;
+	}
+	self->reclaimed_bypass = -1;
 	if (self->playing)
 	{
 		if (self->fd >= 0) ioctl(self->fd, AUDIO_STOP, 0);
@@ -838,13 +1346,15 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 		}
 		self->flushing = FALSE;
 		self->timestamp = GST_CLOCK_TIME_NONE;
-		self->fixed_buffertimestamp = GST_CLOCK_TIME_NONE;
-		if (self->cache)
-		{
-			gst_buffer_unref(self->cache);
-			self->cache = NULL;
-		}
+		self->pcm_timestamp = GST_CLOCK_TIME_NONE;
+		self->pcm_written_end = GST_CLOCK_TIME_NONE;
+		self->pcm_written_blocks = 0;
+		if (self->pcm_adapter) gst_adapter_clear(self->pcm_adapter);
+		if (self->pcm_resample_work) memset(self->pcm_resample_work, 0, self->pcm_resample_history * sizeof(gint32));
 		GST_OBJECT_UNLOCK(self);
+		audio_prepared_drop(self);
+		if (self->aggregate) g_byte_array_set_size(self->aggregate, 0);
+		dvb_reset_lead(&self->io);
 		/* flush while media is playing requires a delay before rendering */
 		if(self->using_dts_downmix && (!self->paused || self->first_paused))
 		{
@@ -857,6 +1367,7 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 	{
 		gboolean pass_eos = FALSE;
 		struct pollfd pfd[2];
+		gst_dvbaudiosink_aggregate_drain(self, TRUE);
 #ifdef AUDIO_FLUSH
 		if (self->fd >= 0) ioctl(self->fd, AUDIO_FLUSH, 1/*NONBLOCK*/); //Notify the player that no addionional data will be injected
 #endif
@@ -920,25 +1431,7 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 
 			if (rate != self->rate)
 			{
-				int video_fd = open("/dev/dvb/adapter0/video0", O_RDWR);
-				if (video_fd >= 0)
-				{
-					GST_INFO_OBJECT(self, "GST_EVENT_SEGMENT IS VIDEO0 OPEN ?");
-					int skip = 0, repeat = 0;
-					if (rate > 1.0)
-					{
-						skip = (int)rate;
-					}
-					else if (rate < 1.0)
-					{
-						repeat = 1.0 / rate;
-					}
-					ioctl(video_fd, VIDEO_SLOWMOTION, repeat);
-					ioctl(video_fd, VIDEO_FAST_FORWARD, skip);
-					ioctl(video_fd, VIDEO_CONTINUE);
-					close(video_fd);
-					video_fd = -1;
-				}
+				dvb_device_set_rate(self->adapter, self->video_decoder, rate);
 				self->rate = rate;
 			}
 		}
@@ -974,202 +1467,293 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 	return ret;
 }
 
-static int audio_write(GstDVBAudioSink *self, GstBuffer *buffer, size_t start, size_t end)
+static void audio_gather_clear(GstDVBAudioSink *self)
 {
-	size_t written = start;
-	size_t len = end;
-	struct pollfd pfd[2];
-	guint8 *data;
-	int retval = 0;
-	GstMapInfo map;
-	gst_buffer_map(buffer, &map, GST_MAP_READ);
-	data = map.data;
-
-	pfd[0].fd = self->unlockfd[0];
-	pfd[0].events = POLLIN;
-	pfd[1].fd = self->fd;
-	pfd[1].events = POLLOUT;
-
-	do
-	{
-		if (self->flushing)
-		{
-			GST_INFO_OBJECT(self, "flushing, skip %d bytes", len - written);
-			break;
-		}
-		else if (self->paused || self->unlocking)
-		{
-			GST_OBJECT_LOCK(self);
-			queue_push(&self->queue, buffer, written, end);
-			GST_OBJECT_UNLOCK(self);
-			GST_DEBUG_OBJECT(self, "pushed %d bytes to queue", len - written);
-			break;
-		}
-		else
-		{
-			GST_LOG_OBJECT(self, "going into poll, have %d bytes to write", len - written);
-		}
-#if defined(__sh__) && !defined(CHECK_DRAIN)
-		pfd[1].revents = POLLOUT;
-#else
-		if (poll(pfd, 2, -1) < 0)
-		{
-			if (errno == EINTR) continue;
-			retval = -1;
-			break;
-		}
-#endif
-		if (pfd[0].revents & POLLIN)
-		{
-			/* read all stop commands */
-			while (1)
-			{
-				gchar command;
-				int res = read(self->unlockfd[0], &command, 1);
-				if (res < 0)
-				{
-					GST_DEBUG_OBJECT(self, "no more commands");
-					/* no more commands */
-					break;
-				}
-			}
-			continue;
-		}
-		if (pfd[1].revents & POLLOUT)
-		{
-			size_t queuestart, queueend;
-			GstBuffer *queuebuffer;
-			GST_OBJECT_LOCK(self);
-			if (queue_front(&self->queue, &queuebuffer, &queuestart, &queueend) >= 0)
-			{
-				guint8 *queuedata;
-				GstMapInfo queuemap;
-				gst_buffer_map(queuebuffer, &queuemap, GST_MAP_READ);
-				queuedata = queuemap.data;
-				int wr = write(self->fd, queuedata + queuestart, queueend - queuestart);
-				gst_buffer_unmap(queuebuffer, &queuemap);
-				if (wr < 0)
-				{
-					switch(errno)
-					{
-						case EINTR:
-						case EAGAIN:
-							break;
-						default:
-							GST_OBJECT_UNLOCK(self);
-							retval = -3;
-							break;
-					}
-					if (retval < 0) break;
-				}
-				else if (wr >= queueend - queuestart)
-				{
-					queue_pop(&self->queue);
-					GST_DEBUG_OBJECT(self, "written %d queue bytes... pop entry", wr);
-				}
-				else
-				{
-					self->queue->start += wr;
-					GST_DEBUG_OBJECT(self, "written %d queue bytes... update offset", wr);
-				}
-				GST_OBJECT_UNLOCK(self);
-				continue;
-			}
-			GST_OBJECT_UNLOCK(self);
-			int wr = write(self->fd, data + written, len - written);
-			if (wr < 0)
-			{
-				switch(errno)
-				{
-					case EINTR:
-					case EAGAIN:
-						continue;
-					default:
-						retval = -3;
-						break;
-				}
-				if (retval < 0) break;
-			}
-			written += wr;
-		}
-	} while (written < len);
-
-	gst_buffer_unmap(buffer, &map);
-	return retval;
+	dvb_gather_clear(self->gather_spans, self->gather_headers);
+	self->gather_pts = GST_CLOCK_TIME_NONE;
 }
 
-GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buffer)
+/* lead-high-watermark. While gathering the pts is only noted,
+ * audio_gather_finish paces the whole lot. */
+static void audio_pace(GstDVBAudioSink *self, GstClockTime pts)
 {
-	guint8 *pes_header;
-	gsize pes_header_len = 0;
-	gsize size;
-	guint8 *data, *original_data;
-	guint8 *codec_data = NULL;
-	gsize codec_data_size = 0;
-	GstClockTime timestamp = self->timestamp;
-	GstClockTime duration = GST_BUFFER_DURATION(buffer);
-	GstMapInfo map, pesheadermap, codecdatamap;
-	gst_buffer_map(buffer, &map, GST_MAP_READ);
-	original_data = data = map.data;
-	size = map.size;
-	gst_buffer_map(self->pesheader_buffer, &pesheadermap, GST_MAP_WRITE);
-	pes_header = pesheadermap.data;
-
-	if (self->codec_data)
+	if (pts == GST_CLOCK_TIME_NONE)
 	{
-		gst_buffer_map(self->codec_data, &codecdatamap, GST_MAP_READ);
-		codec_data = codecdatamap.data;
-		codec_data_size = codecdatamap.size;
+		return;
 	}
-	/* 
-	 * Some audioformats have incorrect timestamps, 
-	 * so if we have both a timestamp and a duration, 
-	 * keep extrapolating from the first timestamp instead
-	 */
-	if (timestamp == GST_CLOCK_TIME_NONE)
+	if (self->gathering)
 	{
-		timestamp = GST_BUFFER_PTS(buffer);
-		if (timestamp != GST_CLOCK_TIME_NONE && duration != GST_CLOCK_TIME_NONE)
-		{
-			self->timestamp = timestamp + duration;
-		}
+		self->gather_pts = pts;
+		return;
 	}
-	else
+	dvb_pace(&self->io, pts, self->lead_high_watermark);
+	dvb_report_lead(&self->io, pts, self->lead_low_watermark);
+}
+
+/* a buffer goes out through the same writer as gathered data, one span per
+ * memory, so a pcm block taken from the adapter isn't merged into a copy */
+static int audio_write(GstDVBAudioSink *self, GstBuffer *buffer, size_t start, size_t end)
+{
+	/* the pes header buffer is rewritten for every packet, keep a copy */
+	gboolean copy = buffer == self->pesheader_buffer;
+	int retval;
+
+	if (self->gathering)
 	{
-		if (duration != GST_CLOCK_TIME_NONE)
-		{
-			self->timestamp += duration;
-		}
-		else
-		{
-			timestamp = GST_BUFFER_PTS(buffer);
-			self->timestamp = GST_CLOCK_TIME_NONE;
-		}
+		dvb_gather(self->gather_spans, self->gather_headers, buffer, copy, start, end);
+		return 0;
 	}
+	dvb_gather(self->write_spans, self->write_headers, buffer, copy, start, end);
+	retval = dvb_write_gathered(&self->io, self->write_spans, self->write_headers);
+	dvb_gather_clear(self->write_spans, self->write_headers);
+	return retval;
+}
 
-	pes_header[0] = 0;
-	pes_header[1] = 0;
-	pes_header[2] = 1;
-	pes_header[3] = 0xc0;
-
-	pes_header[6] = 0x81;
-	pes_header[7] = 0; /* no pts */
-	pes_header[8] = 0;
-	pes_header_len = 9;
+static void gst_dvbaudiosink_update_adts_header(GstDVBAudioSink *self, gsize size)
+{
+	size_t payload_len = size + 7;
+	self->aac_adts_header[3] &= 0xC0;
+	/* frame size over last 2 bits */
+	self->aac_adts_header[3] |= (payload_len & 0x1800) >> 11;
+	/* frame size continued over full byte */
+	self->aac_adts_header[4] = (payload_len & 0x1FF8) >> 3;
+	/* frame size continued first 3 bits */
+	self->aac_adts_header[5] = (payload_len & 7) << 5;
+	/* buffer fullness(0x7FF for VBR) over 5 last bits */
+	self->aac_adts_header[5] |= 0x1F;
+	/* buffer fullness(0x7FF for VBR) continued over 6 first bits + 2 zeros for
+	 * number of raw data blocks */
+	self->aac_adts_header[6] = 0xFC;
+}
 
-	if (self->bypass == AUDIOTYPE_DTS)
+/* compressed formats whose frames the decoder takes several to a pes packet */
+static gboolean gst_dvbaudiosink_can_aggregate(GstDVBAudioSink *self)
+{
+	if (!self->aggregate || !self->aggregate_time || self->fixed_buffersize)
 	{
-		int pos = 0;
-		while ((pos + 4) <= size)
-		{
-			/* check for DTS-HD */
-			if (!strcmp((char*)(data + pos), "\x64\x58\x20\x25"))
-			{
+		return FALSE;
+	}
+	switch (self->bypass)
+	{
+	case AUDIOTYPE_AC3:
+	case AUDIOTYPE_AC3_PLUS:
+	case AUDIOTYPE_MPEG:
+	case AUDIOTYPE_MP3:
+	case AUDIOTYPE_AAC:
+	case AUDIOTYPE_AAC_HE:
+	case AUDIOTYPE_AAC_PLUS:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/* writes the aggregated frames as one pes packet with the pts of the first one */
+static GstFlowReturn gst_dvbaudiosink_aggregate_flush(GstDVBAudioSink *self)
+{
+	guint8 *pes_header;
+	gsize pes_header_len = 9;
+	gsize size = self->aggregate->len;
+	GstClockTime timestamp = self->aggregate_pts;
+	GstMapInfo pesheadermap;
+	GstBuffer *payload;
+
+	if (!size) return GST_FLOW_OK;
+
+	gst_buffer_map(self->pesheader_buffer, &pesheadermap, GST_MAP_WRITE);
+	pes_header = pesheadermap.data;
+	pes_header[0] = 0;
+	pes_header[1] = 0;
+	pes_header[2] = 1;
+	pes_header[3] = 0xc0;
+
+	pes_header[6] = 0x81;
+	pes_header[7] = 0; /* no pts */
+	pes_header[8] = 0;
+	if (timestamp != GST_CLOCK_TIME_NONE)
+	{
+		pes_header[7] = 0x80; /* pts */
+		pes_header[8] = 5; /* pts size */
+		pes_header_len += 5;
+		pes_set_pts(timestamp, pes_header);
+	}
+	pes_set_payload_size(size + pes_header_len - 6, pes_header);
+	gst_buffer_unmap(self->pesheader_buffer, &pesheadermap);
+
+	/* the payload becomes a buffer of its own, the pause queue may hold on to it */
+	payload = gst_buffer_new_wrapped(g_byte_array_free(self->aggregate, FALSE), size);
+	self->aggregate = g_byte_array_sized_new(self->aggregate_size);
+	self->aggregate_pts = GST_CLOCK_TIME_NONE;
+	self->aggregate_end = GST_CLOCK_TIME_NONE;
+	GST_LOG_OBJECT(self, "aggregated pes packet of %" G_GSIZE_FORMAT " bytes", size);
+
+	audio_pace(self, timestamp);
+	if (audio_write(self, self->pesheader_buffer, 0, pes_header_len) < 0 || audio_write(self, payload, 0, size) < 0)
+	{
+		gst_buffer_unref(payload);
+		GST_ELEMENT_ERROR(self, RESOURCE, READ,(NULL),
+				("audio write: %s", g_strerror(errno)));
+		GST_WARNING_OBJECT(self, "Audio write error");
+		return GST_FLOW_ERROR;
+	}
+	gst_buffer_unref(payload);
+	if (timestamp != GST_CLOCK_TIME_NONE)
+	{
+		self->pts_written = TRUE;
+	}
+	return GST_FLOW_OK;
+}
+
+/*
+ * Adds a frame to the pending pes packet, which goes out once it covers
+ * aggregate-time or the next frame would take it past aggregate-size.
+ */
+static GstFlowReturn gst_dvbaudiosink_aggregate(GstDVBAudioSink *self, GstBuffer *buffer, GstClockTime timestamp, GstClockTime duration)
+{
+	gsize size = gst_buffer_get_size(buffer);
+	gsize header_size = self->aac_adts_header_valid ? 7 : 0;
+	gsize len = self->aggregate->len;
+	GstFlowReturn ret = GST_FLOW_OK;
+
+	if (len && timestamp != GST_CLOCK_TIME_NONE && self->aggregate_pts != GST_CLOCK_TIME_NONE && (timestamp < self->aggregate_pts ||
+		(self->aggregate_end != GST_CLOCK_TIME_NONE && (timestamp + AUDIO_AGGREGATE_JITTER < self->aggregate_end || timestamp > self->aggregate_end + AUDIO_AGGREGATE_JITTER))))
+	{
+		/* the frame doesn't continue the pending ones, it can't go out under their pts */
+		GST_DEBUG_OBJECT(self, "discontinuity at %" GST_TIME_FORMAT ", flushing aggregate", GST_TIME_ARGS(timestamp));
+		ret = gst_dvbaudiosink_aggregate_flush(self);
+		if (ret != GST_FLOW_OK) return ret;
+		len = 0;
+	}
+	if (len && (len + header_size + size > self->aggregate_size ||
+			(self->aggregate_pts != GST_CLOCK_TIME_NONE && timestamp != GST_CLOCK_TIME_NONE && timestamp >= self->aggregate_pts + self->aggregate_time)))
+	{
+		ret = gst_dvbaudiosink_aggregate_flush(self);
+		if (ret != GST_FLOW_OK) return ret;
+	}
+	if (!self->aggregate->len)
+	{
+		self->aggregate_pts = timestamp;
+		self->aggregate_end = timestamp;
+	}
+	if (self->aggregate_end != GST_CLOCK_TIME_NONE)
+	{
+		/* where the next frame has to start to join this packet */
+		self->aggregate_end = duration != GST_CLOCK_TIME_NONE ? self->aggregate_end + duration : GST_CLOCK_TIME_NONE;
+	}
+	if (header_size)
+	{
+		/* every aac frame keeps its own adts header */
+		gst_dvbaudiosink_update_adts_header(self, size);
+		g_byte_array_append(self->aggregate, self->aac_adts_header, 7);
+	}
+	len = self->aggregate->len;
+	g_byte_array_set_size(self->aggregate, len + size);
+	gst_buffer_extract(buffer, 0, self->aggregate->data + len, size);
+
+	if (self->aggregate->len >= self->aggregate_size ||
+		(self->aggregate_pts != GST_CLOCK_TIME_NONE && timestamp != GST_CLOCK_TIME_NONE && duration != GST_CLOCK_TIME_NONE &&
+		timestamp + duration >= self->aggregate_pts + self->aggregate_time))
+	{
+		ret = gst_dvbaudiosink_aggregate_flush(self);
+	}
+	return ret;
+}
+
+/* writes a pending aggregate from outside of render, after whatever prepare
+ * gathered for a buffer that wasn't rendered yet. At eos no buffer is left
+ * to render, so spans of a dropped one are forgotten and the frames written
+ * directly. */
+static void gst_dvbaudiosink_aggregate_drain(GstDVBAudioSink *self, gboolean eos)
+{
+	if (!self->aggregate || !self->aggregate->len) return;
+	if (eos) audio_prepared_drop(self);
+	self->gathering = self->prepared != NULL;
+	gst_dvbaudiosink_aggregate_flush(self);
+	self->gathering = FALSE;
+}
+
+GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buffer)
+{
+	guint8 *pes_header;
+	gsize pes_header_len = 0;
+	gsize size = gst_buffer_get_size(buffer);
+	guint8 *codec_data = NULL;
+	gsize codec_data_size = 0;
+	GstClockTime timestamp = self->timestamp;
+	GstClockTime duration = GST_BUFFER_DURATION(buffer);
+	GstMapInfo pesheadermap, codecdatamap;
+	gboolean lpcm_header_missing = FALSE;
+	gst_buffer_map(self->pesheader_buffer, &pesheadermap, GST_MAP_WRITE);
+	pes_header = pesheadermap.data;
+
+	if (self->codec_data)
+	{
+		gst_buffer_map(self->codec_data, &codecdatamap, GST_MAP_READ);
+		codec_data = codecdatamap.data;
+		codec_data_size = codecdatamap.size;
+	}
+	/* 
+	 * Some audioformats have incorrect timestamps, 
+	 * so if we have both a timestamp and a duration, 
+	 * keep extrapolating from the first timestamp instead
+	 */
+	if (timestamp == GST_CLOCK_TIME_NONE)
+	{
+		timestamp = GST_BUFFER_PTS(buffer);
+		if (timestamp != GST_CLOCK_TIME_NONE && duration != GST_CLOCK_TIME_NONE)
+		{
+			self->timestamp = timestamp + duration;
+		}
+	}
+	else
+	{
+		if (duration != GST_CLOCK_TIME_NONE)
+		{
+			self->timestamp += duration;
+		}
+		else
+		{
+			timestamp = GST_BUFFER_PTS(buffer);
+			self->timestamp = GST_CLOCK_TIME_NONE;
+		}
+	}
+
+	if (gst_dvbaudiosink_can_aggregate(self))
+	{
+		gst_buffer_unmap(self->pesheader_buffer, &pesheadermap);
+		if (self->codec_data)
+		{
+			gst_buffer_unmap(self->codec_data, &codecdatamap);
+		}
+		return gst_dvbaudiosink_aggregate(self, buffer, timestamp, duration);
+	}
+
+	pes_header[0] = 0;
+	pes_header[1] = 0;
+	pes_header[2] = 1;
+	pes_header[3] = 0xc0;
+
+	pes_header[6] = 0x81;
+	pes_header[7] = 0; /* no pts */
+	pes_header[8] = 0;
+	pes_header_len = 9;
+
+	if (self->bypass == AUDIOTYPE_DTS)
+	{
+		int pos = 0;
+		GstMapInfo map;
+		gst_buffer_map(buffer, &map, GST_MAP_READ);
+		while ((pos + 4) <= size)
+		{
+			/* check for DTS-HD */
+			if (!strcmp((char*)(map.data + pos), "\x64\x58\x20\x25"))
+			{
 				size = pos;
 				break;
 			}
 			++pos;
 		}
+		gst_buffer_unmap(buffer, &map);
 	}
 
 	if (timestamp != GST_CLOCK_TIME_NONE)
@@ -1182,24 +1766,19 @@ GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buf
 
 	if (self->aac_adts_header_valid)
 	{
-		size_t payload_len = size + 7;
-		self->aac_adts_header[3] &= 0xC0;
-		/* frame size over last 2 bits */
-		self->aac_adts_header[3] |= (payload_len & 0x1800) >> 11;
-		/* frame size continued over full byte */
-		self->aac_adts_header[4] = (payload_len & 0x1FF8) >> 3;
-		/* frame size continued first 3 bits */
-		self->aac_adts_header[5] = (payload_len & 7) << 5;
-		/* buffer fullness(0x7FF for VBR) over 5 last bits */
-		self->aac_adts_header[5] |= 0x1F;
-		/* buffer fullness(0x7FF for VBR) continued over 6 first bits + 2 zeros for
-		 * number of raw data blocks */
-		self->aac_adts_header[6] = 0xFC;
+		gst_dvbaudiosink_update_adts_header(self, size);
 		memcpy(pes_header + pes_header_len, self->aac_adts_header, 7);
 		pes_header_len += 7;
 	}
 
-	if (self->bypass == AUDIOTYPE_LPCM && (data[0] < 0xa0 || data[0] > 0xaf))
+	if (self->bypass == AUDIOTYPE_LPCM)
+	{
+		guint8 id = 0;
+		gst_buffer_extract(buffer, 0, &id, 1);
+		lpcm_header_missing = id < 0xa0 || id > 0xaf;
+	}
+
+	if (lpcm_header_missing)
 	{
 		/*
 		 * gstmpegdemux removes the streamid and the number of frames
@@ -1262,8 +1841,9 @@ GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buf
 	}
 
 	pes_set_payload_size(size + pes_header_len - 6, pes_header);
+	audio_pace(self, timestamp);
 	if (audio_write(self, self->pesheader_buffer, 0, pes_header_len) < 0) goto error;
-	if (audio_write(self, buffer, data - original_data, data - original_data + size) < 0) goto error;
+	if (audio_write(self, buffer, 0, size) < 0) goto error;
 	if (timestamp != GST_CLOCK_TIME_NONE)
 	{
 		self->pts_written = TRUE;
@@ -1273,7 +1853,6 @@ GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buf
 	{
 		gst_buffer_unmap(self->codec_data, &codecdatamap);
 	}
-	gst_buffer_unmap(buffer, &map);
 
 	return GST_FLOW_OK;
 error:
@@ -1282,7 +1861,6 @@ error:
 	{
 		gst_buffer_unmap(self->codec_data, &codecdatamap);
 	}
-	gst_buffer_unmap(buffer, &map);
 	{
 		GST_ELEMENT_ERROR(self, RESOURCE, READ,(NULL),
 				("audio write: %s", g_strerror(errno)));
@@ -1291,7 +1869,347 @@ error:
 	}
 }
 
-static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffer)
+/*
+ * pcm conversion kernels, plain loops over whole samples without
+ * dependencies between iterations, so the compiler can vectorize them
+ */
+static void pcm_swap16(guint8 *dst, const guint8 *src, gsize samples)
+{
+	const guint16 *in = (const guint16 *)src;
+	guint16 *out = (guint16 *)dst;
+	gsize i;
+	for (i = 0; i < samples; i++)
+	{
+		out[i] = GUINT16_SWAP_LE_BE(in[i]);
+	}
+}
+
+static void pcm_swap24(guint8 *dst, const guint8 *src, gsize samples)
+{
+	gsize i;
+	for (i = 0; i < samples * 3; i += 3)
+	{
+		dst[i] = src[i + 2];
+		dst[i + 1] = src[i + 1];
+		dst[i + 2] = src[i];
+	}
+}
+
+static void pcm_swap32(guint8 *dst, const guint8 *src, gsize samples)
+{
+	const guint32 *in = (const guint32 *)src;
+	guint32 *out = (guint32 *)dst;
+	gsize i;
+	for (i = 0; i < samples; i++)
+	{
+		out[i] = GUINT32_SWAP_LE_BE(in[i]);
+	}
+}
+
+static inline gint32 pcm_f32_sample(gfloat value)
+{
+	value *= 2147483648.0f;
+	/* 2147483520 is the largest float below 2^31 */
+	value = value > 2147483520.0f ? 2147483520.0f : value;
+	value = value < -2147483648.0f ? -2147483648.0f : value;
+	return (gint32)value;
+}
+
+static inline gint32 pcm_f64_sample(gdouble value)
+{
+	value *= 2147483648.0;
+	value = value > 2147483647.0 ? 2147483647.0 : value;
+	value = value < -2147483648.0 ? -2147483648.0 : value;
+	return (gint32)value;
+}
+
+static void pcm_f32_to_s32(guint8 *dst, const guint8 *src, gsize samples, gboolean swap)
+{
+	const guint32 *in = (const guint32 *)src;
+	gint32 *out = (gint32 *)dst;
+	union { guint32 i; gfloat f; } value;
+	gsize i;
+	if (swap)
+	{
+		for (i = 0; i < samples; i++)
+		{
+			value.i = GUINT32_SWAP_LE_BE(in[i]);
+			out[i] = pcm_f32_sample(value.f);
+		}
+	}
+	else
+	{
+		for (i = 0; i < samples; i++)
+		{
+			value.i = in[i];
+			out[i] = pcm_f32_sample(value.f);
+		}
+	}
+}
+
+static void pcm_f64_to_s32(guint8 *dst, const guint8 *src, gsize samples, gboolean swap)
+{
+	const guint64 *in = (const guint64 *)src;
+	gint32 *out = (gint32 *)dst;
+	union { guint64 i; gdouble f; } value;
+	gsize i;
+	if (swap)
+	{
+		for (i = 0; i < samples; i++)
+		{
+			value.i = GUINT64_SWAP_LE_BE(in[i]);
+			out[i] = pcm_f64_sample(value.f);
+		}
+	}
+	else
+	{
+		for (i = 0; i < samples; i++)
+		{
+			value.i = in[i];
+			out[i] = pcm_f64_sample(value.f);
+		}
+	}
+}
+
+static int pcm_convert_input_size(int convert)
+{
+	switch (convert)
+	{
+	case PCM_CONVERT_SWAP16:
+		return 2;
+	case PCM_CONVERT_SWAP24:
+		return 3;
+	case PCM_CONVERT_F64:
+	case PCM_CONVERT_F64_SWAP:
+		return 8;
+	default:
+		return 4;
+	}
+}
+
+static void pcm_convert(int convert, guint8 *dst, const guint8 *src, gsize samples)
+{
+	switch (convert)
+	{
+	case PCM_CONVERT_SWAP16:
+		pcm_swap16(dst, src, samples);
+		break;
+	case PCM_CONVERT_SWAP24:
+		pcm_swap24(dst, src, samples);
+		break;
+	case PCM_CONVERT_SWAP32:
+		pcm_swap32(dst, src, samples);
+		break;
+	case PCM_CONVERT_F32:
+	case PCM_CONVERT_F32_SWAP:
+		pcm_f32_to_s32(dst, src, samples, convert == PCM_CONVERT_F32_SWAP);
+		break;
+	case PCM_CONVERT_F64:
+	case PCM_CONVERT_F64_SWAP:
+		pcm_f64_to_s32(dst, src, samples, convert == PCM_CONVERT_F64_SWAP);
+		break;
+	}
+}
+
+/*
+ * Returns a writable payload buffer of the given size with the timestamps of
+ * the block. The buffer is kept in *cache and reused as long as nobody else
+ * (the pause queue) holds it.
+ */
+static GstBuffer *gst_dvbaudiosink_pcm_payload(GstBuffer **cache, gsize size, GstBuffer *block)
+{
+	GstBuffer *payload = *cache;
+	if (!payload || !gst_buffer_is_writable(payload) || gst_buffer_get_size(payload) != size)
+	{
+		if (payload) gst_buffer_unref(payload);
+		payload = *cache = gst_buffer_new_allocate(NULL, size, NULL);
+	}
+	gst_buffer_ref(payload);
+	GST_BUFFER_PTS(payload) = GST_BUFFER_PTS(block);
+	GST_BUFFER_DURATION(payload) = GST_BUFFER_DURATION(block);
+	return payload;
+}
+
+/*
+ * Converts a pcm block into the payload buffer which goes to the decoder.
+ */
+static GstBuffer *gst_dvbaudiosink_convert_pcm(GstDVBAudioSink *self, GstBuffer *block)
+{
+	int input_size = pcm_convert_input_size(self->pcm_convert);
+	int output_size = self->pcm_convert >= PCM_CONVERT_F32 ? 4 : input_size;
+	gsize samples = gst_buffer_get_size(block) / input_size;
+	guint n_memory = gst_buffer_n_memory(block);
+	GstBuffer *payload = gst_dvbaudiosink_pcm_payload(&self->pcm_convert_buffer, samples * output_size, block);
+	GstMapInfo outmap;
+	guint8 *out;
+	guint i;
+
+	gst_buffer_map(payload, &outmap, GST_MAP_WRITE);
+	out = outmap.data;
+	for (i = 0; i < n_memory; i++)
+	{
+		if (gst_memory_get_sizes(gst_buffer_peek_memory(block, i), NULL, NULL) % input_size) break;
+	}
+	if (i == n_memory)
+	{
+		/* convert memory by memory, straight from the input buffers */
+		for (i = 0; i < n_memory; i++)
+		{
+			GstMapInfo map;
+			gst_buffer_map_range(block, i, 1, &map, GST_MAP_READ);
+			pcm_convert(self->pcm_convert, out, map.data, map.size / input_size);
+			out += map.size / input_size * output_size;
+			gst_buffer_unmap(block, &map);
+		}
+	}
+	else
+	{
+		/* samples straddle input buffers, let gstreamer merge them first */
+		GstMapInfo map;
+		gst_buffer_map(block, &map, GST_MAP_READ);
+		pcm_convert(self->pcm_convert, out, map.data, samples);
+		gst_buffer_unmap(block, &map);
+	}
+	gst_buffer_unmap(payload, &outmap);
+	return payload;
+}
+
+static void gst_dvbaudiosink_downmix_span(GstDVBAudioSink *self, guint8 *dst, const guint8 *src, gsize frames)
+{
+	int channels = self->pcm_downmix_channels;
+	if (self->pcm_width == 16)
+	{
+		if (self->pcm_downmix_mask == PCM_MASK_5_1)
+			pcm_downmix_s16((gint16 *)dst, (const gint16 *)src, frames, 6, pcm_downmix_5_1_left, pcm_downmix_5_1_right);
+		else if (self->pcm_downmix_mask == PCM_MASK_7_1)
+			pcm_downmix_s16((gint16 *)dst, (const gint16 *)src, frames, 8, pcm_downmix_7_1_left, pcm_downmix_7_1_right);
+		else
+			pcm_downmix_s16((gint16 *)dst, (const gint16 *)src, frames, channels, self->pcm_downmix_left, self->pcm_downmix_right);
+	}
+	else
+	{
+		if (self->pcm_downmix_mask == PCM_MASK_5_1)
+			pcm_downmix_s32((gint32 *)dst, (const gint32 *)src, frames, 6, pcm_downmix_5_1_left, pcm_downmix_5_1_right);
+		else if (self->pcm_downmix_mask == PCM_MASK_7_1)
+			pcm_downmix_s32((gint32 *)dst, (const gint32 *)src, frames, 8, pcm_downmix_7_1_left, pcm_downmix_7_1_right);
+		else
+			pcm_downmix_s32((gint32 *)dst, (const gint32 *)src, frames, channels, self->pcm_downmix_left, self->pcm_downmix_right);
+	}
+}
+
+/*
+ * Downmixes a native s16/s32 block to stereo, reading the input memories in
+ * place and writing the payload buffer which goes to the decoder.
+ */
+static GstBuffer *gst_dvbaudiosink_downmix_pcm(GstDVBAudioSink *self, GstBuffer *block)
+{
+	int sample_size = self->pcm_width / 8;
+	int frame_size = self->pcm_downmix_channels * sample_size;
+	gsize frames = gst_buffer_get_size(block) / frame_size;
+	guint n_memory = gst_buffer_n_memory(block);
+	GstBuffer *payload = gst_dvbaudiosink_pcm_payload(&self->pcm_downmix_buffer, frames * 2 * sample_size, block);
+	GstMapInfo outmap;
+	guint8 *out;
+	guint i;
+
+	gst_buffer_map(payload, &outmap, GST_MAP_WRITE);
+	out = outmap.data;
+	for (i = 0; i < n_memory; i++)
+	{
+		if (gst_memory_get_sizes(gst_buffer_peek_memory(block, i), NULL, NULL) % frame_size) break;
+	}
+	if (i == n_memory)
+	{
+		for (i = 0; i < n_memory; i++)
+		{
+			GstMapInfo map;
+			gst_buffer_map_range(block, i, 1, &map, GST_MAP_READ);
+			gst_dvbaudiosink_downmix_span(self, out, map.data, map.size / frame_size);
+			out += map.size / frame_size * 2 * sample_size;
+			gst_buffer_unmap(block, &map);
+		}
+	}
+	else
+	{
+		GstMapInfo map;
+		gst_buffer_map(block, &map, GST_MAP_READ);
+		gst_dvbaudiosink_downmix_span(self, out, map.data, frames);
+		gst_buffer_unmap(block, &map);
+	}
+	gst_buffer_unmap(payload, &outmap);
+	return payload;
+}
+
+#ifdef PCM_MAX_RATE
+/*
+ * Decimates a native S16/S32 pcm block by pcm_resample_factor. Only the
+ * output samples are computed, the filter history of the previous block
+ * is kept in front of the work area.
+ */
+static GstBuffer *gst_dvbaudiosink_resample_pcm(GstDVBAudioSink *self, GstBuffer *block)
+{
+	int channels = self->pcm_channels;
+	int width = self->pcm_width / 8;
+	int factor = self->pcm_resample_factor;
+	const gint16 *coeffs = factor == 2 ? pcm_decimate2_taps : pcm_decimate4_taps;
+	int taps = factor == 2 ? G_N_ELEMENTS(pcm_decimate2_taps) : G_N_ELEMENTS(pcm_decimate4_taps);
+	gsize history = self->pcm_resample_history;
+	gsize samples = gst_buffer_get_size(block) / width;
+	gsize out_frames = samples / channels / factor;
+	GstBuffer *payload;
+	GstMapInfo outmap;
+	gint32 *work;
+	gsize i, j;
+	int c;
+
+	if (self->pcm_resample_work_size < history + samples)
+	{
+		self->pcm_resample_work_size = history + samples;
+		self->pcm_resample_work = g_realloc(self->pcm_resample_work, self->pcm_resample_work_size * sizeof(gint32));
+	}
+	work = self->pcm_resample_work;
+	if (width == 4)
+	{
+		gst_buffer_extract(block, 0, work + history, samples * 4);
+	}
+	else
+	{
+		gint16 *in = (gint16 *)(work + history);
+		gst_buffer_extract(block, 0, in, samples * 2);
+		/* widen in place, from the end so every sample is read before it gets overwritten */
+		for (i = samples; i-- > 0;)
+		{
+			work[history + i] = in[i];
+		}
+	}
+
+	payload = gst_dvbaudiosink_pcm_payload(&self->pcm_resample_buffer, out_frames * channels * width, block);
+	gst_buffer_map(payload, &outmap, GST_MAP_WRITE);
+	for (j = 0; j < out_frames; j++)
+	{
+		/* the window ends at the last input frame belonging to this output frame */
+		const gint32 *window = work + (j * factor + factor - 1) * channels;
+		for (c = 0; c < channels; c++)
+		{
+			gint64 value = pcm_decimate_sample(window + c, coeffs, taps, channels);
+			if (width == 4)
+			{
+				((gint32 *)outmap.data)[j * channels + c] = CLAMP(value, G_MININT32, G_MAXINT32);
+			}
+			else
+			{
+				((gint16 *)outmap.data)[j * channels + c] = CLAMP(value, G_MININT16, G_MAXINT16);
+			}
+		}
+	}
+	gst_buffer_unmap(payload, &outmap);
+
+	memmove(work, work + samples, history * sizeof(gint32));
+	return payload;
+}
+#endif
+
+static GstFlowReturn gst_dvbaudiosink_packetize(GstBaseSink *sink, GstBuffer *buffer)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK(sink);
 	GstBuffer *disposebuffer = NULL;
@@ -1320,13 +2238,16 @@ static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffe
 
 	if (GST_BUFFER_IS_DISCONT(buffer)) 
 	{
-		if (self->cache) 
+		/* never carry the timestamp of the frames before the gap over it */
+		if (self->aggregate && self->aggregate->len)
 		{
-			gst_buffer_unref(self->cache);
-			self->cache = NULL;
+			retval = gst_dvbaudiosink_aggregate_flush(self);
+			if (retval != GST_FLOW_OK) return retval;
 		}
+		gst_adapter_clear(self->pcm_adapter);
 		self->timestamp = GST_CLOCK_TIME_NONE;
-		self->fixed_buffertimestamp = GST_CLOCK_TIME_NONE;
+		self->pcm_timestamp = GST_CLOCK_TIME_NONE;
+		if (self->pcm_resample_work) memset(self->pcm_resample_work, 0, self->pcm_resample_history * sizeof(gint32));
 	}
 
 	disposebuffer = buffer;
@@ -1344,78 +2265,213 @@ static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffe
 		buffersize = gst_buffer_get_size(buffer);
 	}
 
-	if (self->cache)
+	if (self->fixed_buffersize)
 	{
-		/* join unrefs both buffers */
-		buffer = gst_buffer_append(self->cache, buffer);
-		buffersize = gst_buffer_get_size(buffer);
-		GST_BUFFER_PTS(buffer) = timestamp;
-		GST_BUFFER_DURATION(buffer) = duration;
-		disposebuffer = buffer;
-		self->cache = NULL;
-	}
-
-	if (buffer)
-	{
-		if (self->fixed_buffersize)
+		if (self->pcm_timestamp == GST_CLOCK_TIME_NONE)
+		{
+			self->pcm_timestamp = timestamp;
+			self->pcm_samples = 0;
+		}
+		/* the adapter takes over our ref, leftovers stay in there as subbuffers of the input */
+		gst_adapter_push(self->pcm_adapter, buffer);
+		disposebuffer = NULL;
+		while (gst_adapter_available(self->pcm_adapter) >= self->fixed_buffersize)
 		{
-			if (self->fixed_buffertimestamp == GST_CLOCK_TIME_NONE)
+			guint64 samples = self->fixed_buffersize / self->pcm_frame_size;
+			GstBuffer *block = gst_adapter_take_buffer_fast(self->pcm_adapter, self->fixed_buffersize);
+			if (self->pcm_timestamp != GST_CLOCK_TIME_NONE)
 			{
-				self->fixed_buffertimestamp = timestamp;
+				/* both edges come from the sample counter, so rounding errors don't add up */
+				GstClockTime end = self->pcm_timestamp + gst_util_uint64_scale_int(self->pcm_samples + samples, GST_SECOND, self->pcm_rate);
+				GST_BUFFER_PTS(block) = self->pcm_timestamp + gst_util_uint64_scale_int(self->pcm_samples, GST_SECOND, self->pcm_rate);
+				GST_BUFFER_DURATION(block) = end - GST_BUFFER_PTS(block);
 			}
-			if (buffersize < self->fixed_buffersize)
+			self->pcm_samples += samples;
+			if (self->pcm_convert != PCM_CONVERT_NONE)
 			{
-				self->cache = gst_buffer_copy(buffer);
-				retval = GST_FLOW_OK;
+				GstBuffer *payload = gst_dvbaudiosink_convert_pcm(self, block);
+				gst_buffer_unref(block);
+				block = payload;
 			}
-			else if (buffersize > self->fixed_buffersize)
+			if (self->pcm_downmix_channels)
 			{
-				int index = 0;
-				while (index <= buffersize - self->fixed_buffersize)
-				{
-					GstBuffer *block;
-					block = gst_buffer_copy_region(buffer, GST_BUFFER_COPY_ALL, index, self->fixed_buffersize);
-					/* only the first buffer needs the correct timestamp, next buffer timestamps will be ignored (and extrapolated) */
-					GST_BUFFER_PTS(block) = self->fixed_buffertimestamp;
-					GST_BUFFER_DURATION(block) = self->fixed_bufferduration;
-					self->fixed_buffertimestamp += self->fixed_bufferduration;
-					gst_dvbaudiosink_push_buffer(self, block);
-					gst_buffer_unref(block);
-					index += self->fixed_buffersize;
-				}
-				if (index < buffersize)
-				{
-					self->cache = gst_buffer_copy_region(buffer, GST_BUFFER_COPY_ALL, index, buffersize - index);
-				}
-				retval = GST_FLOW_OK;
+				GstBuffer *payload = gst_dvbaudiosink_downmix_pcm(self, block);
+				gst_buffer_unref(block);
+				block = payload;
 			}
-			else
+#ifdef PCM_MAX_RATE
+			if (self->pcm_resample_factor > 1)
 			{
-				/* could still be the original buffer, make sure we can write metadata */
-				if (!gst_buffer_is_writable(buffer))
-				{
-					GstBuffer *tmpbuf = gst_buffer_copy(buffer);
-					GST_BUFFER_DURATION(tmpbuf) = self->fixed_bufferduration;
-					retval = gst_dvbaudiosink_push_buffer(self, tmpbuf);
-					gst_buffer_unref(tmpbuf);
-				}
-				else
-				{
-					GST_BUFFER_DURATION(buffer) = self->fixed_bufferduration;
-					retval = gst_dvbaudiosink_push_buffer(self, buffer);
-				}
+				GstBuffer *payload = gst_dvbaudiosink_resample_pcm(self, block);
+				gst_buffer_unref(block);
+				block = payload;
 			}
+#endif
+			retval = gst_dvbaudiosink_push_buffer(self, block);
+			if (retval == GST_FLOW_OK && GST_BUFFER_PTS_IS_VALID(block))
+			{
+				self->pcm_written_end = GST_BUFFER_PTS(block) + GST_BUFFER_DURATION(block);
+				self->pcm_written_blocks++;
+			}
+			gst_buffer_unref(block);
+			if (retval != GST_FLOW_OK) break;
 		}
-		else
-		{
-			retval = gst_dvbaudiosink_push_buffer(self, buffer);
-		}
+		/* gathered blocks haven't been written yet, audio_gather_finish tunes after them */
+		if (!self->gathering) gst_dvbaudiosink_tune_pcm_block_time(self);
+	}
+	else
+	{
+		retval = gst_dvbaudiosink_push_buffer(self, buffer);
 	}
 
 	if (disposebuffer) gst_buffer_unref(disposebuffer);
 	return retval;
 }
 
+/*
+ * prepare runs before the clock wait, so the pes packetizing is done there
+ * and gathered, render then only writes. prepared tells render that the
+ * gathered spans belong to its buffer (or list). When basesink drops the
+ * buffer instead of rendering it, the spans are forgotten and the state the
+ * packetizing moved on is put back. Whatever can't be put back stays in
+ * render: the pcm adapter, sample counter and resampler history, the
+ * aggregated frames, and the wait after a flush, which would only make the
+ * buffer late.
+ */
+static void audio_prepared_drop(GstDVBAudioSink *self)
+{
+	if (self->prepared)
+	{
+		GST_DEBUG_OBJECT(self, "dropping packetized data which wasn't rendered");
+		audio_gather_clear(self);
+		self->pts_written = self->prepared_pts_written;
+		/* the next buffer's own timestamp is the place to extrapolate from */
+		self->timestamp = GST_CLOCK_TIME_NONE;
+		self->prepared = NULL;
+	}
+}
+
+/* FALSE when the buffer is left to render */
+static gboolean audio_prepare_begin(GstDVBAudioSink *self)
+{
+	audio_prepared_drop(self);
+	if (self->fd < 0 || !self->gather_spans || self->ok_to_write == 0 || self->fixed_buffersize ||
+		gst_dvbaudiosink_can_aggregate(self) || (self->aggregate && self->aggregate->len))
+	{
+		return FALSE;
+	}
+	self->prepared_pts_written = self->pts_written;
+	self->gathering = TRUE;
+	return TRUE;
+}
+
+static GstFlowReturn audio_prepare_end(GstDVBAudioSink *self, gconstpointer prepared, GstFlowReturn ret)
+{
+	self->gathering = FALSE;
+	if (ret != GST_FLOW_OK)
+	{
+		audio_gather_clear(self);
+		return ret;
+	}
+	self->prepared = prepared;
+	return GST_FLOW_OK;
+}
+
+static GstFlowReturn gst_dvbaudiosink_prepare(GstBaseSink *sink, GstBuffer *buffer)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(sink);
+
+	if (!audio_prepare_begin(self))
+	{
+		return GST_FLOW_OK;
+	}
+	return audio_prepare_end(self, buffer, gst_dvbaudiosink_packetize(sink, buffer));
+}
+
+/* the whole list is packetized in one go, so it leaves in a few writev calls */
+static GstFlowReturn gst_dvbaudiosink_prepare_list(GstBaseSink *sink, GstBufferList *list)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(sink);
+	GstFlowReturn ret = GST_FLOW_OK;
+	guint i, len = gst_buffer_list_length(list);
+
+	if (!audio_prepare_begin(self))
+	{
+		return GST_FLOW_OK;
+	}
+	for (i = 0; i < len && ret == GST_FLOW_OK; i++)
+	{
+		ret = gst_dvbaudiosink_packetize(sink, gst_buffer_list_get(list, i));
+	}
+	return audio_prepare_end(self, list, ret);
+}
+
+/* writes what was gathered since gathering was switched on */
+static GstFlowReturn audio_gather_finish(GstDVBAudioSink *self, GstFlowReturn ret)
+{
+	self->gathering = FALSE;
+
+	if (ret != GST_FLOW_OK)
+	{
+		audio_gather_clear(self);
+		return ret;
+	}
+	audio_pace(self, self->gather_pts);
+	if (self->gather_spans->len && dvb_write_gathered(&self->io, self->gather_spans, self->gather_headers) < 0)
+	{
+		GST_ELEMENT_ERROR(self, RESOURCE, READ,(NULL),
+				("audio write: %s", g_strerror(errno)));
+		GST_WARNING_OBJECT(self, "Audio write error");
+		audio_gather_clear(self);
+		return GST_FLOW_ERROR;
+	}
+	audio_gather_clear(self);
+	gst_dvbaudiosink_tune_pcm_block_time(self);
+	return GST_FLOW_OK;
+}
+
+static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffer)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(sink);
+
+	if (self->prepared && self->prepared == (gpointer)buffer)
+	{
+		self->prepared = NULL;
+		return audio_gather_finish(self, GST_FLOW_OK);
+	}
+	return gst_dvbaudiosink_packetize(sink, buffer);
+}
+
+/* renders every buffer of the list as usual, but writes them all at once */
+static GstFlowReturn gst_dvbaudiosink_render_list(GstBaseSink *sink, GstBufferList *list)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(sink);
+	GstFlowReturn ret = GST_FLOW_OK;
+	guint i, len = gst_buffer_list_length(list);
+
+	if (self->prepared && self->prepared == (gpointer)list)
+	{
+		self->prepared = NULL;
+		return audio_gather_finish(self, GST_FLOW_OK);
+	}
+	if (self->fd < 0 || !self->gather_spans)
+	{
+		/* nothing to gather for, each buffer goes through render on its own */
+		for (i = 0; i < len && ret == GST_FLOW_OK; i++)
+		{
+			ret = gst_dvbaudiosink_render(sink, gst_buffer_list_get(list, i));
+		}
+		return ret;
+	}
+
+	self->gathering = TRUE;
+	for (i = 0; i < len && ret == GST_FLOW_OK; i++)
+	{
+		ret = gst_dvbaudiosink_packetize(sink, gst_buffer_list_get(list, i));
+	}
+	return audio_gather_finish(self, ret);
+}
+
 static gboolean gst_dvbaudiosink_start(GstBaseSink * basesink)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK(basesink);
@@ -1432,8 +2488,28 @@ static gboolean gst_dvbaudiosink_start(GstBaseSink * basesink)
 	fcntl(self->unlockfd[1], F_SETFL, O_NONBLOCK);
 
 	self->pesheader_buffer = gst_buffer_new_and_alloc(256);
-
-	self->fd = open("/dev/dvb/adapter0/audio0", O_RDWR | O_NONBLOCK);
+	self->pcm_adapter = gst_adapter_new();
+	self->gather_spans = g_array_new(FALSE, FALSE, sizeof(dvb_span_t));
+	self->gather_headers = g_byte_array_new();
+	self->write_spans = g_array_new(FALSE, FALSE, sizeof(dvb_span_t));
+	self->write_headers = g_byte_array_new();
+	self->aggregate = g_byte_array_new();
+	self->aggregate_pts = GST_CLOCK_TIME_NONE;
+	self->aggregate_end = GST_CLOCK_TIME_NONE;
+
+	self->device = dvb_device_open(DVB_DEVICE_AUDIO, self->adapter, self->decoder);
+	self->fd = self->device ? self->device->fd : -1;
+
+	self->reclaimed_bypass = -1;
+	if (self->device && self->device->playing)
+	{
+		/* keep the decoder running, set_caps only reprograms it when the bypass differs */
+		GST_INFO_OBJECT(self, "reclaimed running decoder, bypass 0x%02x", self->device->stream_type);
+		ioctl(self->fd, AUDIO_CLEAR_BUFFER);
+		self->playing = TRUE;
+		self->reclaimed_bypass = self->device->stream_type;
+		self->device->playing = FALSE;
+	}
 
 	self->pts_written = FALSE;
 	self->lastpts = 0;
@@ -1452,28 +2528,38 @@ static gboolean gst_dvbaudiosink_stop(GstBaseSink * basesink)
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK(basesink);
 
 	GST_DEBUG_OBJECT(self, "stop");
+	dvb_reset_lead(&self->io);
 
 	if (self->fd >= 0)
 	{
-		if (self->playing)
+		if (self->playing && !self->keep_device_open)
 		{
 			ioctl(self->fd, AUDIO_STOP);
 			self->playing = FALSE;
 		}
-		ioctl(self->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_DEMUX);
 
 		if (self->rate != 1.0)
 		{
-			int video_fd = open("/dev/dvb/adapter0/video0", O_RDWR);
-			if (video_fd >= 0)
+			dvb_device_set_rate(self->adapter, self->video_decoder, 1.0);
+			self->rate = 1.0;
+		}
+		/* leave the decoder as it is, the registry stops it when no sink reclaims it in time */
+		if (self->keep_device_open && dvb_device_park(self->device, self->playing, self->bypass, NULL))
+		{
+			self->playing = FALSE;
+		}
+		else
+		{
+			if (self->playing)
 			{
-				ioctl(video_fd, VIDEO_SLOWMOTION, 0);
-				ioctl(video_fd, VIDEO_FAST_FORWARD, 0);
-				close(video_fd);
+				ioctl(self->fd, AUDIO_STOP);
+				self->playing = FALSE;
 			}
-			self->rate = 1.0;
+			ioctl(self->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_DEMUX);
+			self->device->source = AUDIO_SOURCE_DEMUX;
+			dvb_device_close(self->device);
 		}
-		close(self->fd);
+		self->device = NULL;
 		self->fd = -1;
 	}
 
@@ -1489,12 +2575,57 @@ static gboolean gst_dvbaudiosink_stop(GstBaseSink * basesink)
 		self->pesheader_buffer = NULL;
 	}
 
-	if (self->cache)
+	if (self->pcm_adapter)
+	{
+		g_object_unref(self->pcm_adapter);
+		self->pcm_adapter = NULL;
+	}
+
+	if (self->aggregate)
+	{
+		g_byte_array_free(self->aggregate, TRUE);
+		self->aggregate = NULL;
+	}
+
+	self->prepared = NULL;
+	if (self->gather_spans)
+	{
+		audio_gather_clear(self);
+		g_array_free(self->gather_spans, TRUE);
+		g_byte_array_free(self->gather_headers, TRUE);
+		self->gather_spans = NULL;
+		self->gather_headers = NULL;
+	}
+	if (self->write_spans)
 	{
-		gst_buffer_unref(self->cache);
-		self->cache = NULL;
+		g_array_free(self->write_spans, TRUE);
+		g_byte_array_free(self->write_headers, TRUE);
+		self->write_spans = NULL;
+		self->write_headers = NULL;
 	}
 
+	if (self->pcm_convert_buffer)
+	{
+		gst_buffer_unref(self->pcm_convert_buffer);
+		self->pcm_convert_buffer = NULL;
+	}
+
+	if (self->pcm_resample_buffer)
+	{
+		gst_buffer_unref(self->pcm_resample_buffer);
+		self->pcm_resample_buffer = NULL;
+	}
+
+	if (self->pcm_downmix_buffer)
+	{
+		gst_buffer_unref(self->pcm_downmix_buffer);
+		self->pcm_downmix_buffer = NULL;
+	}
+
+	g_free(self->pcm_resample_work);
+	self->pcm_resample_work = NULL;
+	self->pcm_resample_history = self->pcm_resample_work_size = 0;
+
 	while (self->queue)
 	{
 		queue_pop(&self->queue);
@@ -1531,7 +2662,11 @@ static GstStateChangeReturn gst_dvbaudiosink_change_state(GstElement *element, G
 		self->first_paused = TRUE;
 		if (self->fd >= 0)
 		{
-			ioctl(self->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_MEMORY);
+			if (self->device->source != AUDIO_SOURCE_MEMORY)
+			{
+				ioctl(self->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_MEMORY);
+				self->device->source = AUDIO_SOURCE_MEMORY;
+			}
 			ioctl(self->fd, AUDIO_PAUSE);
 		}
 		if(get_downmix_ready())
@@ -1565,6 +2700,10 @@ static GstStateChangeReturn gst_dvbaudiosink_change_state(GstElement *element, G
 		}
 		/* wakeup the poll */
 		write(self->unlockfd[1], "\x01", 1);
+		/* the frames held back for aggregation go to the pause queue as well */
+		GST_BASE_SINK_PREROLL_LOCK(GST_BASE_SINK(self));
+		gst_dvbaudiosink_aggregate_drain(self, FALSE);
+		GST_BASE_SINK_PREROLL_UNLOCK(GST_BASE_SINK(self));
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
 		GST_INFO_OBJECT(self,"GST_STATE_CHANGE_PAUSED_TO_READY");
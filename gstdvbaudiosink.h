@@ -113,17 +113,43 @@ struct _GstDVBAudioSink
 
 	GstBuffer *pesheader_buffer;
 	GstBuffer *codec_data;
-	GstBuffer *cache;
+	GstAdapter *pcm_adapter;
 	gboolean reset_time;
 
+	dvb_device_t *device;
 	int fd;
 	int unlockfd[2];
 
 	int skip;
 	int bypass;
+	/* bypass of a running decoder reclaimed from the registry, -1 if none */
+	int reclaimed_bypass;
 	int fixed_buffersize;
-	GstClockTime fixed_buffertimestamp;
-	GstClockTime fixed_bufferduration;
+	int pcm_rate, pcm_frame_size;
+	GstClockTime pcm_timestamp;
+	guint64 pcm_samples;
+	int pcm_convert;
+	GstBuffer *pcm_convert_buffer;
+	int pcm_channels, pcm_width;
+	int pcm_downmix_channels;
+	guint64 pcm_downmix_mask;
+	gint16 pcm_downmix_left[8], pcm_downmix_right[8];
+	GstBuffer *pcm_downmix_buffer;
+	int pcm_resample_factor;
+	gint32 *pcm_resample_work;
+	gsize pcm_resample_history, pcm_resample_work_size;
+	GstBuffer *pcm_resample_buffer;
+	GstClockTime pcm_block_time, pcm_auto_block_time;
+	guint pcm_auto_blocks;
+	/* end of the pcm blocks written since the lead was last sampled, and how many */
+	GstClockTime pcm_written_end;
+	guint pcm_written_blocks;
+	gint64 poll_wait;
+
+	/* compressed frames waiting to go out in one pes packet */
+	GByteArray *aggregate;
+	GstClockTime aggregate_pts, aggregate_end, aggregate_time;
+	guint aggregate_size;
 
 	GstClockTime timestamp;
 	gdouble rate;
@@ -135,8 +161,30 @@ struct _GstDVBAudioSink
 	gint8 ok_to_write;
 
 	gboolean use_set_encoding;
+	gboolean keep_device_open;
+	int adapter, decoder;
+	/* the video decoder trick mode rates are programmed on */
+	int video_decoder;
 
 	queue_entry_t *queue;
+	/* what the write loops shared with the video sink see of this one */
+	dvb_sink_io_t io;
+
+	/* prepare packetizes into the gathered spans, render only writes them */
+	gboolean gathering;
+	GArray *gather_spans;
+	GByteArray *gather_headers;
+	/* spans of a single direct write, kept apart from what prepare gathered */
+	GArray *write_spans;
+	GByteArray *write_headers;
+	gconstpointer prepared;
+	/* pts_written before the packetizing in prepare, put back when it is dropped */
+	gboolean prepared_pts_written;
+	/* pts of the last gathered packet, what audio_pace() waits for */
+	GstClockTime gather_pts;
+
+	/* lead the writes are capped at and below which buffering is posted */
+	GstClockTime lead_high_watermark, lead_low_watermark;
 };
 
 struct _GstDVBAudioSinkClass
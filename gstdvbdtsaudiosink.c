@@ -0,0 +1,177 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-dvbdtsaudiosink
+ *
+ * Decodes DTS with dtsdownmix and feeds the stereo result straight into
+ * dvbaudiosink, without the audioconvert/queue pair playbin would put in
+ * between.  The decoder is switched to integer output, so the samples
+ * already leave the interleave step in the S16 layout the sink writes.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * <para>
+ * <programlisting>
+ * gst-launch-1.0 filesrc location=movie.dts ! dcaparse ! dvbdtsaudiosink
+ * </programlisting>
+ * </para>
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gst/gst.h>
+
+#include "gstdvbdtsaudiosink.h"
+
+GST_DEBUG_CATEGORY_STATIC(dvbdtsaudiosink_debug);
+#define GST_CAT_DEFAULT dvbdtsaudiosink_debug
+
+enum
+{
+	PROP_0,
+	PROP_SYNC,
+	PROP_ADAPTER,
+	PROP_DECODER,
+};
+
+static GstStaticPadTemplate sink_factory =
+GST_STATIC_PAD_TEMPLATE(
+	"sink",
+	GST_PAD_SINK,
+	GST_PAD_ALWAYS,
+	GST_STATIC_CAPS("audio/x-dts; audio/x-private1-dts")
+);
+
+G_DEFINE_TYPE(GstDVBDtsAudioSink, gst_dvbdtsaudiosink, GST_TYPE_BIN);
+
+static void gst_dvbdtsaudiosink_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
+static void gst_dvbdtsaudiosink_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
+
+static void gst_dvbdtsaudiosink_class_init(GstDVBDtsAudioSinkClass *self)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(self);
+	GstElementClass *element_class = GST_ELEMENT_CLASS(self);
+
+	gobject_class->set_property = gst_dvbdtsaudiosink_set_property;
+	gobject_class->get_property = gst_dvbdtsaudiosink_get_property;
+
+	gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&sink_factory));
+	gst_element_class_set_static_metadata(element_class,
+		"DVB DTS audio sink",
+		"Generic/DVBAudioSink",
+		"Decodes DTS and outputs the stereo downmix into a linuxtv dvb audio device",
+		"PLi team");
+
+	g_object_class_install_property (gobject_class, PROP_SYNC,
+			g_param_spec_boolean ("sync", "Sync", "Sync on the clock", FALSE,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_ADAPTER,
+			g_param_spec_int ("adapter", "Adapter", "Index of the dvb adapter, used when the sink is started", 0, 255, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_DECODER,
+			g_param_spec_int ("decoder", "Decoder", "Index of the audio decoder, used when the sink is started", 0, 255, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+}
+
+static void gst_dvbdtsaudiosink_init(GstDVBDtsAudioSink *self)
+{
+	GstPadTemplate *templ;
+	GstPad *target;
+
+	self->decoder = gst_element_factory_make("dtsdownmix", NULL);
+	self->sink = gst_element_factory_make("dvbaudiosink", NULL);
+	if (!self->decoder || !self->sink)
+	{
+		GST_ERROR_OBJECT(self, "dtsdownmix or dvbaudiosink missing, the bin stays empty");
+		if (self->decoder) gst_object_unref(self->decoder);
+		if (self->sink) gst_object_unref(self->sink);
+		self->decoder = self->sink = NULL;
+		return;
+	}
+
+	/* the sink takes S16 natively, let the decoder interleave into it */
+	g_object_set(self->decoder, "integer-output", TRUE, NULL);
+
+	gst_bin_add_many(GST_BIN(self), self->decoder, self->sink, NULL);
+	if (!gst_element_link_pads(self->decoder, "src", self->sink, "sink"))
+	{
+		GST_ERROR_OBJECT(self, "could not link dtsdownmix to dvbaudiosink");
+	}
+
+	target = gst_element_get_static_pad(self->decoder, "sink");
+	templ = gst_static_pad_template_get(&sink_factory);
+	self->sinkpad = gst_ghost_pad_new_from_template("sink", target, templ);
+	gst_object_unref(templ);
+	gst_object_unref(target);
+	gst_element_add_pad(GST_ELEMENT(self), self->sinkpad);
+}
+
+static void gst_dvbdtsaudiosink_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	GstDVBDtsAudioSink *self = GST_DVBDTSAUDIOSINK(object);
+
+	switch (prop_id)
+	{
+	case PROP_SYNC:
+		if (self->sink) g_object_set_property(G_OBJECT(self->sink), "sync", value);
+		break;
+	case PROP_ADAPTER:
+		if (self->sink) g_object_set_property(G_OBJECT(self->sink), "adapter", value);
+		break;
+	case PROP_DECODER:
+		if (self->sink) g_object_set_property(G_OBJECT(self->sink), "decoder", value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+static void gst_dvbdtsaudiosink_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	GstDVBDtsAudioSink *self = GST_DVBDTSAUDIOSINK(object);
+
+	switch (prop_id)
+	{
+	case PROP_SYNC:
+		if (self->sink) g_object_get_property(G_OBJECT(self->sink), "sync", value);
+		break;
+	case PROP_ADAPTER:
+		if (self->sink) g_object_get_property(G_OBJECT(self->sink), "adapter", value);
+		break;
+	case PROP_DECODER:
+		if (self->sink) g_object_get_property(G_OBJECT(self->sink), "decoder", value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+gboolean gst_dvbdtsaudiosink_register(GstPlugin *plugin)
+{
+	GST_DEBUG_CATEGORY_INIT(dvbdtsaudiosink_debug, "dvbdtsaudiosink", 0, "dvbdtsaudiosink element");
+	return gst_element_register(plugin, "dvbdtsaudiosink", GST_RANK_NONE, GST_TYPE_DVBDTSAUDIOSINK);
+}
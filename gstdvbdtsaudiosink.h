@@ -0,0 +1,58 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_DVBDTSAUDIOSINK_H__
+#define __GST_DVBDTSAUDIOSINK_H__
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_DVBDTSAUDIOSINK \
+  (gst_dvbdtsaudiosink_get_type())
+#define GST_DVBDTSAUDIOSINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_DVBDTSAUDIOSINK,GstDVBDtsAudioSink))
+#define GST_DVBDTSAUDIOSINK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_DVBDTSAUDIOSINK,GstDVBDtsAudioSinkClass))
+#define GST_IS_DVBDTSAUDIOSINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_DVBDTSAUDIOSINK))
+#define GST_IS_DVBDTSAUDIOSINK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_DVBDTSAUDIOSINK))
+
+typedef struct _GstDVBDtsAudioSink		GstDVBDtsAudioSink;
+typedef struct _GstDVBDtsAudioSinkClass	GstDVBDtsAudioSinkClass;
+
+struct _GstDVBDtsAudioSink
+{
+	GstBin bin;
+
+	GstElement *decoder;
+	GstElement *sink;
+	GstPad *sinkpad;
+};
+
+struct _GstDVBDtsAudioSinkClass
+{
+	GstBinClass parent_class;
+};
+
+GType gst_dvbdtsaudiosink_get_type(void);
+gboolean gst_dvbdtsaudiosink_register(GstPlugin *plugin);
+
+G_END_DECLS
+
+#endif /* __GST_DVBDTSAUDIOSINK_H__ */
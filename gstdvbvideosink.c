@@ -72,6 +72,7 @@
 #include <gst/base/gstbasesink.h>
 
 #include "common.h"
+#include "mpeg4p2.h"
 #include "gstdvbvideosink.h"
 #include "gstdvbsink-marshal.h"
 
@@ -140,6 +141,12 @@ enum
 {
 	PROP_0,
 	PROP_SYNC,
+	PROP_KEEP_DEVICE_OPEN,
+	PROP_ADAPTER,
+	PROP_DECODER,
+	PROP_PACING_LEAD,
+	PROP_LEAD_HIGH_WATERMARK,
+	PROP_LEAD_LOW_WATERMARK,
 	PROP_LAST,
 };
 
@@ -160,7 +167,9 @@ GST_STATIC_PAD_TEMPLATE (
 #ifdef HAVE_MPEG4
 	"video/mpeg, "
 		"mpegversion = (int) 4, "
-		"unpacked = (boolean) true, "
+		VIDEO_CAPS "; "
+	"video/x-divx, "
+		"divxversion = (int) [ 4, 5 ], "
 		VIDEO_CAPS "; "
 #endif
 	"video/mpeg, "
@@ -270,6 +279,14 @@ static gboolean gst_dvbvideosink_start (GstBaseSink * sink);
 static gboolean gst_dvbvideosink_stop (GstBaseSink * sink);
 static gboolean gst_dvbvideosink_event (GstBaseSink * sink, GstEvent * event);
 static GstFlowReturn gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer);
+static GstFlowReturn gst_dvbvideosink_render_list (GstBaseSink * sink, GstBufferList * list);
+static GstFlowReturn gst_dvbvideosink_prepare (GstBaseSink * sink, GstBuffer * buffer);
+static GstFlowReturn gst_dvbvideosink_prepare_list (GstBaseSink * sink, GstBufferList * list);
+static void video_prepared_drop (GstDVBVideoSink * self);
+static void video_handle_event (GstElement * sink);
+static GstFlowReturn gst_dvbvideosink_render_frame (GstBaseSink * sink, GstBuffer * buffer);
+static GstFlowReturn gst_dvbvideosink_unpacked_push (gpointer user_data, GstBuffer * buffer);
+static GstFlowReturn gst_dvbvideosink_unpacked_push_list (gpointer user_data, GstBufferList * list);
 static gboolean gst_dvbvideosink_set_caps (GstBaseSink * sink, GstCaps * caps);
 static gboolean gst_dvbvideosink_unlock (GstBaseSink * basesink);
 static gboolean gst_dvbvideosink_unlock_stop (GstBaseSink * basesink);
@@ -301,9 +318,39 @@ static void gst_dvbvideosink_class_init(GstDVBVideoSinkClass *self)
 			g_param_spec_boolean ("sync", "Sync", "Sync on the clock", FALSE,
 					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+	g_object_class_install_property (gobject_class, PROP_KEEP_DEVICE_OPEN,
+			g_param_spec_boolean ("keep-device-open", "Keep device open", "Keep the decoder programmed for a short while after stop, so the next sink can reuse it", FALSE,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_ADAPTER,
+			g_param_spec_int ("adapter", "Adapter", "Index of the dvb adapter, used when the sink is started", 0, 255, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_DECODER,
+			g_param_spec_int ("decoder", "Decoder", "Index of the video decoder, used when the sink is started", 0, 255, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_PACING_LEAD,
+			g_param_spec_uint64 ("pacing-lead", "Pacing lead", "Hold data back while it is more than this many nanoseconds ahead of the decoder pts, so bursts of a live source queue up in front of the sink instead of in the decoder, 0 writes as fast as the decoder takes it",
+					0, 10 * GST_SECOND, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_LEAD_HIGH_WATERMARK,
+			g_param_spec_uint64 ("lead-high-watermark", "Lead high watermark", "Never write data more than this many nanoseconds ahead of the decoder pts, which bounds what a flush throws away, 0 is no limit",
+					0, 10 * GST_SECOND, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_LEAD_LOW_WATERMARK,
+			g_param_spec_uint64 ("lead-low-watermark", "Lead low watermark", "Post buffering messages while the data written is less than this many nanoseconds ahead of the decoder pts, 0 posts none",
+					0, 10 * GST_SECOND, 0,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
 	gstbasesink_class->start = GST_DEBUG_FUNCPTR (gst_dvbvideosink_start);
 	gstbasesink_class->stop = GST_DEBUG_FUNCPTR (gst_dvbvideosink_stop);
 	gstbasesink_class->render = GST_DEBUG_FUNCPTR (gst_dvbvideosink_render);
+	gstbasesink_class->render_list = GST_DEBUG_FUNCPTR (gst_dvbvideosink_render_list);
+	gstbasesink_class->prepare = GST_DEBUG_FUNCPTR (gst_dvbvideosink_prepare);
+	gstbasesink_class->prepare_list = GST_DEBUG_FUNCPTR (gst_dvbvideosink_prepare_list);
 	gstbasesink_class->event = GST_DEBUG_FUNCPTR (gst_dvbvideosink_event);
 	gstbasesink_class->unlock = GST_DEBUG_FUNCPTR (gst_dvbvideosink_unlock);
 	gstbasesink_class->unlock_stop = GST_DEBUG_FUNCPTR (gst_dvbvideosink_unlock_stop);
@@ -343,11 +390,43 @@ static void gst_dvbvideosink_init(GstDVBVideoSink *self)
 	self->lastpts = 0;
 	self->timestamp_offset = 0;
 	self->queue = NULL;
+	self->io.element = GST_ELEMENT(self);
+	self->io.category = GST_CAT_DEFAULT;
+	self->io.fd = &self->fd;
+	self->io.unlockfd = &self->unlockfd[0];
+	self->io.get_pts = VIDEO_GET_PTS;
+	self->io.events = POLLPRI;
+	self->io.handle_event = video_handle_event;
+	self->io.skip_poll = FALSE;
+	self->io.playing = &self->playing;
+	self->io.paused = &self->paused;
+	self->io.flushing = &self->flushing;
+	self->io.unlocking = &self->unlocking;
+	self->io.pts_written = &self->pts_written;
+	self->io.rate = &self->rate;
+	self->io.queue = &self->queue;
+	self->io.buffering_percent = 100;
+	self->io.poll_wait = NULL;
+	self->gathering = FALSE;
+	self->gather_spans = NULL;
+	self->gather_headers = NULL;
+	self->prepared = NULL;
+	self->prepared_must_send_header = FALSE;
+	self->prepared_pts_written = self->prepared_audelim_written = FALSE;
+	self->pacing_lead = 0;
+	self->lead_high_watermark = self->lead_low_watermark = 0;
+	self->gather_pts = GST_CLOCK_TIME_NONE;
+	self->unpack_mpeg4p2 = FALSE;
+	mpeg4p2_unpacker_init(&self->mpeg4p2, GST_OBJECT(self),
+			gst_dvbvideosink_unpacked_push, gst_dvbvideosink_unpacked_push_list, self);
+	self->device = NULL;
 	self->fd = -1;
 	self->unlockfd[0] = self->unlockfd[1] = -1;
 	self->saved_fallback_framerate[0] = 0;
 	self->rate = 1.0;
 	self->wmv_asf = FALSE;
+	self->keep_device_open = FALSE;
+	self->adapter = self->decoder = 0;
 #ifdef VIDEO_SET_ENCODING
 	self->use_set_encoding = TRUE;
 #else
@@ -385,6 +464,24 @@ static void gst_dvbvideosink_set_property (GObject * object, guint prop_id, cons
 	case PROP_SYNC:
 		GST_INFO_OBJECT(self, "ignoring attempt to change 'sync' to '%d'", g_value_get_boolean(value));
 		break;
+	case PROP_KEEP_DEVICE_OPEN:
+		self->keep_device_open = g_value_get_boolean(value);
+		break;
+	case PROP_ADAPTER:
+		self->adapter = g_value_get_int(value);
+		break;
+	case PROP_DECODER:
+		self->decoder = g_value_get_int(value);
+		break;
+	case PROP_PACING_LEAD:
+		self->pacing_lead = g_value_get_uint64(value);
+		break;
+	case PROP_LEAD_HIGH_WATERMARK:
+		self->lead_high_watermark = g_value_get_uint64(value);
+		break;
+	case PROP_LEAD_LOW_WATERMARK:
+		self->lead_low_watermark = g_value_get_uint64(value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -400,6 +497,24 @@ static void gst_dvbvideosink_get_property (GObject * object, guint prop_id, GVal
 	case PROP_SYNC:
 		g_value_set_boolean(value, gst_base_sink_get_sync(GST_BASE_SINK(object)));
 		break;
+	case PROP_KEEP_DEVICE_OPEN:
+		g_value_set_boolean(value, self->keep_device_open);
+		break;
+	case PROP_ADAPTER:
+		g_value_set_int(value, self->adapter);
+		break;
+	case PROP_DECODER:
+		g_value_set_int(value, self->decoder);
+		break;
+	case PROP_PACING_LEAD:
+		g_value_set_uint64(value, self->pacing_lead);
+		break;
+	case PROP_LEAD_HIGH_WATERMARK:
+		g_value_set_uint64(value, self->lead_high_watermark);
+		break;
+	case PROP_LEAD_LOW_WATERMARK:
+		g_value_set_uint64(value, self->lead_low_watermark);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -473,12 +588,15 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 		}
 		self->flushing = FALSE;
 		GST_OBJECT_UNLOCK(self);
+		video_prepared_drop(self);
+		mpeg4p2_unpacker_flush(&self->mpeg4p2);
 		/* flush while media is playing requires a delay before rendering */
 		if (self->using_dts_downmix && !self->paused)
 		{
 			self->ok_to_write = 0;
 			self->playing = FALSE;
 		}
+		dvb_reset_lead(&self->io);
 		self->flushed = TRUE;
 		break;
 	case GST_EVENT_EOS:
@@ -548,18 +666,7 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 			self->timestamp_offset = start - pos;
 			if (rate != self->rate)
 			{
-				int skip = 0, repeat = 0;
-				if (rate > 1.0)
-				{
-					skip = (int)rate;
-				}
-				else if (rate < 1.0)
-				{
-					repeat = 1.0 / rate;
-				}
-				ioctl(self->fd, VIDEO_SLOWMOTION, repeat);
-				ioctl(self->fd, VIDEO_FAST_FORWARD, skip);
-				ioctl(self->fd, VIDEO_CONTINUE);
+				dvb_device_set_rate(self->adapter, self->decoder, rate);
 				self->rate = rate;
 			}
 		}
@@ -609,6 +716,72 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 	return ret;
 }
 
+/* posts the decoder event behind a POLLPRI as an element message */
+static void video_handle_event(GstElement *sink)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(sink);
+	GstStructure *s;
+	GstMessage *msg;
+	struct video_event evt;
+	if (ioctl(self->fd, VIDEO_GET_EVENT, &evt) < 0)
+	{
+		g_warning("failed to ioctl VIDEO_GET_EVENT!");
+	}
+	else
+	{
+		GST_INFO_OBJECT (self, "VIDEO_EVENT %d", evt.type);
+		if (evt.type == VIDEO_EVENT_SIZE_CHANGED) {
+			s = gst_structure_new ("eventSizeChanged",
+				"aspect_ratio", G_TYPE_INT, evt.u.size.aspect_ratio == 0 ? 2 : 3,
+				"width", G_TYPE_INT, evt.u.size.w,
+				"height", G_TYPE_INT, evt.u.size.h, NULL);
+			msg = gst_message_new_element (GST_OBJECT(sink), s);
+			gst_element_post_message (GST_ELEMENT(sink), msg);
+		}
+		else if (evt.type == VIDEO_EVENT_FRAME_RATE_CHANGED)
+		{
+			s = gst_structure_new ("eventFrameRateChanged",
+				"frame_rate", G_TYPE_INT, evt.u.frame_rate, NULL);
+			msg = gst_message_new_element (GST_OBJECT(sink), s);
+			gst_element_post_message (GST_ELEMENT(sink), msg);
+		}
+		else if (evt.type == 16 /*VIDEO_EVENT_PROGRESSIVE_CHANGED*/)
+		{
+			s = gst_structure_new ("eventProgressiveChanged",
+				"progressive", G_TYPE_INT, evt.u.frame_rate, NULL);
+			msg = gst_message_new_element (GST_OBJECT(sink), s);
+			gst_element_post_message (GST_ELEMENT(sink), msg);
+		}
+		else
+		{
+			g_warning ("unhandled DVBAPI Video Event %d", evt.type);
+		}
+	}
+}
+
+static void video_gather_clear(GstDVBVideoSink *self)
+{
+	dvb_gather_clear(self->gather_spans, self->gather_headers);
+	self->gather_pts = GST_CLOCK_TIME_NONE;
+}
+
+/* pacing-lead and lead-high-watermark, the smaller of the two is waited for */
+static void video_pace(GstDVBVideoSink *self, GstClockTime pts)
+{
+	GstClockTime limit = self->pacing_lead;
+
+	if (pts == GST_CLOCK_TIME_NONE)
+	{
+		return;
+	}
+	if (self->lead_high_watermark && (!limit || self->lead_high_watermark < limit))
+	{
+		limit = self->lead_high_watermark;
+	}
+	dvb_pace(&self->io, pts, limit);
+	dvb_report_lead(&self->io, pts, self->lead_low_watermark);
+}
+
 static int video_write(GstBaseSink *sink, GstDVBVideoSink *self, GstBuffer *buffer, size_t start, size_t end)
 {
 	size_t written = start;
@@ -617,6 +790,14 @@ static int video_write(GstBaseSink *sink, GstDVBVideoSink *self, GstBuffer *buff
 	guint8 *data;
 	int retval = 0;
 	GstMapInfo map;
+
+	if (self->gathering)
+	{
+		/* the pes header buffer is rewritten for every frame, keep a copy */
+		dvb_gather(self->gather_spans, self->gather_headers, buffer, buffer == self->pesheader_buffer, start, end);
+		return 0;
+	}
+
 	gst_buffer_map(buffer, &map, GST_MAP_READ);
 	data = map.data;
 
@@ -667,85 +848,17 @@ static int video_write(GstBaseSink *sink, GstDVBVideoSink *self, GstBuffer *buff
 		}
 		if (pfd[1].revents & POLLPRI)
 		{
-			GstStructure *s;
-			GstMessage *msg;
-			struct video_event evt;
-			if (ioctl(self->fd, VIDEO_GET_EVENT, &evt) < 0)
-			{
-				g_warning("failed to ioctl VIDEO_GET_EVENT!");
-			}
-			else
-			{
-				GST_INFO_OBJECT (self, "VIDEO_EVENT %d", evt.type);
-				if (evt.type == VIDEO_EVENT_SIZE_CHANGED) {
-					s = gst_structure_new ("eventSizeChanged",
-						"aspect_ratio", G_TYPE_INT, evt.u.size.aspect_ratio == 0 ? 2 : 3,
-						"width", G_TYPE_INT, evt.u.size.w,
-						"height", G_TYPE_INT, evt.u.size.h, NULL);
-					msg = gst_message_new_element (GST_OBJECT(sink), s);
-					gst_element_post_message (GST_ELEMENT(sink), msg);
-				}
-				else if (evt.type == VIDEO_EVENT_FRAME_RATE_CHANGED)
-				{
-					s = gst_structure_new ("eventFrameRateChanged",
-						"frame_rate", G_TYPE_INT, evt.u.frame_rate, NULL);
-					msg = gst_message_new_element (GST_OBJECT(sink), s);
-					gst_element_post_message (GST_ELEMENT(sink), msg);
-				}
-				else if (evt.type == 16 /*VIDEO_EVENT_PROGRESSIVE_CHANGED*/)
-				{
-					s = gst_structure_new ("eventProgressiveChanged",
-						"progressive", G_TYPE_INT, evt.u.frame_rate, NULL);
-					msg = gst_message_new_element (GST_OBJECT(sink), s);
-					gst_element_post_message (GST_ELEMENT(sink), msg);
-				}
-				else
-				{
-					g_warning ("unhandled DVBAPI Video Event %d", evt.type);
-				}
-			}
+			video_handle_event(GST_ELEMENT(self));
 		}
 		if (pfd[1].revents & POLLOUT)
 		{
-			size_t queuestart, queueend;
-			GstBuffer *queuebuffer;
-			GST_OBJECT_LOCK(self);
-			if (queue_front(&self->queue, &queuebuffer, &queuestart, &queueend) >= 0)
+			int queued = dvb_write_queue(&self->io);
+			if (queued < 0)
 			{
-				guint8 *queuedata;
-				GstMapInfo queuemap;
-				gst_buffer_map(queuebuffer, &queuemap, GST_MAP_READ);
-				queuedata = queuemap.data;
-				int wr = write(self->fd, queuedata + queuestart, queueend - queuestart);
-				gst_buffer_unmap(queuebuffer, &queuemap);
-				if (wr < 0)
-				{
-					switch (errno)
-					{
-						case EINTR:
-						case EAGAIN:
-							break;
-						default:
-							GST_OBJECT_UNLOCK(self);
-							retval = -3;
-							break;
-					}
-					if (retval < 0) break;
-				}
-				else if (wr >= queueend - queuestart)
-				{
-					queue_pop(&self->queue);
-					GST_TRACE_OBJECT (self, "written %d queue bytes... pop entry", wr);
-				}
-				else
-				{
-					self->queue->start += wr;
-					GST_TRACE_OBJECT (self, "written %d queue bytes... update offset", wr);
-				}
-				GST_OBJECT_UNLOCK(self);
-				continue;
+				retval = queued;
+				break;
 			}
-			GST_OBJECT_UNLOCK(self);
+			if (queued) continue;
 			int wr = write(self->fd, data + written, len - written);
 			if (wr < 0)
 			{
@@ -768,7 +881,7 @@ static int video_write(GstBaseSink *sink, GstDVBVideoSink *self, GstBuffer *buff
 	return retval;
 }
 
-static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffer)
+static GstFlowReturn gst_dvbvideosink_render_frame(GstBaseSink *sink, GstBuffer *buffer)
 {
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK(sink);
 	guint8 *pes_header;
@@ -872,6 +985,16 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 		pes_header_len += 5;
 		pes_set_pts(GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer), pes_header);
 
+		if (self->gathering)
+		{
+			/* paced as a whole once the gathered data is written */
+			self->gather_pts = GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer);
+		}
+		else
+		{
+			video_pace(self, GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer));
+		}
+
 		if (self->codec_data)
 		{
 			if (self->must_send_header)
@@ -1127,12 +1250,206 @@ error:
 	}
 }
 
+/* packed MPEG-4 part 2 goes through the unpacker first, which hands the
+ * frames back to render_frame in presentation order */
+static GstFlowReturn gst_dvbvideosink_packetize(GstBaseSink *sink, GstBuffer *buffer)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(sink);
+
+	if (self->unpack_mpeg4p2 && self->fd >= 0)
+	{
+		/* the unpacker keeps and retimes the frame, so it gets its own buffer */
+		GstFlowReturn ret = mpeg4p2_unpacker_chain(&self->mpeg4p2, gst_buffer_copy(buffer));
+		if (self->mpeg4p2.latency_changed)
+		{
+			/* frames held back for reordering are shown that much later */
+			self->mpeg4p2.latency_changed = FALSE;
+			gst_base_sink_set_render_delay(sink, mpeg4p2_unpacker_get_latency(&self->mpeg4p2));
+		}
+		return ret;
+	}
+	return gst_dvbvideosink_render_frame(sink, buffer);
+}
+
+/* writes what was gathered since gathering was switched on */
+static GstFlowReturn video_gather_finish(GstBaseSink *sink, GstDVBVideoSink *self, GstFlowReturn ret)
+{
+	self->gathering = FALSE;
+
+	if (ret != GST_FLOW_OK)
+	{
+		video_gather_clear(self);
+		return ret;
+	}
+	video_pace(self, self->gather_pts);
+	if (self->gather_spans->len && dvb_write_gathered(&self->io, self->gather_spans, self->gather_headers) < 0)
+	{
+		GST_ELEMENT_ERROR(self, RESOURCE, READ, (NULL),
+				("video write: %s", g_strerror (errno)));
+		GST_WARNING_OBJECT (self, "Video write error");
+		video_gather_clear(self);
+		return GST_FLOW_ERROR;
+	}
+	video_gather_clear(self);
+	return GST_FLOW_OK;
+}
+
+/*
+ * prepare runs before the clock wait, so the packetizing is done there and
+ * gathered, render then only writes. prepared tells render that the gathered
+ * spans belong to its buffer (or list). When basesink drops the buffer
+ * instead of rendering it, the spans are forgotten and the little state the
+ * packetizing moved on is put back. Whatever can't be put back stays in
+ * render: the mpeg4p2 unpacker releases frames of earlier buffers, and the
+ * wait after a flush would only make the buffer late.
+ */
+static void video_prepared_drop(GstDVBVideoSink *self)
+{
+	if (self->prepared)
+	{
+		GST_DEBUG_OBJECT(self, "dropping packetized data which wasn't rendered");
+		video_gather_clear(self);
+		/* the codec data may have gone with it */
+		self->must_send_header = self->prepared_must_send_header;
+		self->pts_written = self->prepared_pts_written;
+		self->h264_initial_audelim_written = self->prepared_audelim_written;
+		self->prepared = NULL;
+	}
+}
+
+/* FALSE when the buffer is left to render */
+static gboolean video_prepare_begin(GstDVBVideoSink *self)
+{
+	video_prepared_drop(self);
+	if (self->fd < 0 || self->unpack_mpeg4p2 || self->ok_to_write == 0)
+	{
+		return FALSE;
+	}
+	self->prepared_must_send_header = self->must_send_header;
+	self->prepared_pts_written = self->pts_written;
+	self->prepared_audelim_written = self->h264_initial_audelim_written;
+	self->gathering = TRUE;
+	return TRUE;
+}
+
+static GstFlowReturn video_prepare_end(GstDVBVideoSink *self, gconstpointer prepared, GstFlowReturn ret)
+{
+	self->gathering = FALSE;
+	if (ret != GST_FLOW_OK)
+	{
+		video_gather_clear(self);
+		return ret;
+	}
+	self->prepared = prepared;
+	return GST_FLOW_OK;
+}
+
+static GstFlowReturn gst_dvbvideosink_prepare(GstBaseSink *sink, GstBuffer *buffer)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(sink);
+
+	if (!video_prepare_begin(self))
+	{
+		return GST_FLOW_OK;
+	}
+	return video_prepare_end(self, buffer, gst_dvbvideosink_packetize(sink, buffer));
+}
+
+static GstFlowReturn gst_dvbvideosink_prepare_list(GstBaseSink *sink, GstBufferList *list)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(sink);
+	GstFlowReturn ret = GST_FLOW_OK;
+	guint i, len = gst_buffer_list_length(list);
+
+	if (!video_prepare_begin(self))
+	{
+		return GST_FLOW_OK;
+	}
+	for (i = 0; i < len && ret == GST_FLOW_OK; i++)
+	{
+		ret = gst_dvbvideosink_packetize(sink, gst_buffer_list_get(list, i));
+	}
+	return video_prepare_end(self, list, ret);
+}
+
+static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffer)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(sink);
+
+	if (self->prepared && self->prepared == (gpointer)buffer)
+	{
+		self->prepared = NULL;
+		return video_gather_finish(sink, self, GST_FLOW_OK);
+	}
+	return gst_dvbvideosink_packetize(sink, buffer);
+}
+
+/* renders every buffer of the list as usual, but writes them all at once */
+static GstFlowReturn gst_dvbvideosink_render_list(GstBaseSink *sink, GstBufferList *list)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(sink);
+	GstFlowReturn ret = GST_FLOW_OK;
+	guint i, len = gst_buffer_list_length(list);
+
+	if (self->prepared && self->prepared == (gpointer)list)
+	{
+		self->prepared = NULL;
+		return video_gather_finish(sink, self, GST_FLOW_OK);
+	}
+	if (self->fd < 0 || !self->gather_spans)
+	{
+		/* nothing to gather for, each buffer goes through render on its own */
+		for (i = 0; i < len && ret == GST_FLOW_OK; i++)
+		{
+			ret = gst_dvbvideosink_render(sink, gst_buffer_list_get(list, i));
+		}
+		return ret;
+	}
+
+	self->gathering = TRUE;
+	for (i = 0; i < len && ret == GST_FLOW_OK; i++)
+	{
+		ret = gst_dvbvideosink_packetize(sink, gst_buffer_list_get(list, i));
+	}
+	return video_gather_finish(sink, self, ret);
+}
+
+static GstFlowReturn gst_dvbvideosink_unpacked_push(gpointer user_data, GstBuffer *buffer)
+{
+	GstFlowReturn ret = gst_dvbvideosink_render_frame(GST_BASE_SINK(user_data), buffer);
+	gst_buffer_unref(buffer);
+	return ret;
+}
+
+/* a reordered group from the unpacker, written at once like render_list does,
+ * when render_list is already gathering the group just joins it */
+static GstFlowReturn gst_dvbvideosink_unpacked_push_list(gpointer user_data, GstBufferList *list)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(user_data);
+	GstFlowReturn ret = GST_FLOW_OK;
+	gboolean gathering = self->gathering;
+	guint i, len = gst_buffer_list_length(list);
+
+	self->gathering = TRUE;
+	for (i = 0; i < len && ret == GST_FLOW_OK; i++)
+	{
+		ret = gst_dvbvideosink_render_frame(GST_BASE_SINK(self), gst_buffer_list_get(list, i));
+	}
+	gst_buffer_list_unref(list);
+	if (gathering)
+	{
+		return ret;
+	}
+	return video_gather_finish(GST_BASE_SINK(self), self, ret);
+}
+
 static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 {
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK (basesink);
 	GstStructure *structure = gst_caps_get_structure (caps, 0);
 	const char *mimetype = gst_structure_get_name (structure);
 	t_stream_type prev_stream_type = self->stream_type;
+	gboolean unpack_mpeg4p2 = FALSE;
 	self->stream_type = STREAMTYPE_UNKNOWN;
 	//self->must_send_header = TRUE;
 
@@ -1164,7 +1481,11 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 			break;
 			case 4:
 			{
+				gboolean unpacked = FALSE;
 				self->stream_type = STREAMTYPE_MPEG4_Part2;
+				/* without mpeg4p2unpack in front the stream may still be packed */
+				gst_structure_get_boolean(structure, "unpacked", &unpacked);
+				unpack_mpeg4p2 = !unpacked;
 				const GValue *codec_data = gst_structure_get_value(structure, "codec_data");
 				if (codec_data)
 				{
@@ -1369,6 +1690,7 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 	{
 		self->stream_type = STREAMTYPE_XVID;
 		self->codec_type = CT_MPEG4_PART2;
+		unpack_mpeg4p2 = TRUE;
 		GST_INFO_OBJECT (self, "MIMETYPE video/x-xvid -> STREAMTYPE_XVID");
 	}
 	else if (!strcmp (mimetype, "video/x-divx") || !strcmp (mimetype, "video/x-msmpeg"))
@@ -1425,12 +1747,15 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 				self->codec_type = CT_DIVX4;
 				self->codec_data = gst_buffer_new_and_alloc(12);
 				gst_buffer_fill(self->codec_data, 0, "\x00\x00\x01\xb2\x44\x69\x76\x58\x34\x41\x4e\x44", 12);
+				/* a packed bitstream is split up before it goes to the decoder */
+				unpack_mpeg4p2 = TRUE;
 				GST_INFO_OBJECT (self, "MIMETYPE video/x-divx vers. 4 -> STREAMTYPE_DIVX4");
 			break;
 			case 6:
 			case 5:
 				self->use_dts = TRUE;
 				self->stream_type = STREAMTYPE_DIVX5;
+				unpack_mpeg4p2 = TRUE;
 				GST_INFO_OBJECT (self, "MIMETYPE video/x-divx vers. %d -> STREAMTYPE_DIVX5", divxversion);
 			break;
 			default:
@@ -1460,30 +1785,51 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 		}
 	}
 
+	/* a new stream starts over, a renegotiation of the same one keeps the stored frames */
+	if (!unpack_mpeg4p2 || !self->unpack_mpeg4p2)
+	{
+		mpeg4p2_unpacker_reset(&self->mpeg4p2);
+	}
+	if (unpack_mpeg4p2)
+	{
+		mpeg4p2_unpacker_set_caps(&self->mpeg4p2, structure);
+	}
+	self->unpack_mpeg4p2 = unpack_mpeg4p2;
+	if (self->mpeg4p2.latency_changed)
+	{
+		self->mpeg4p2.latency_changed = FALSE;
+		gst_base_sink_set_render_delay(basesink, mpeg4p2_unpacker_get_latency(&self->mpeg4p2));
+	}
+
 	if (self->stream_type != STREAMTYPE_UNKNOWN)
 	{
 		gint numerator, denominator;
 		if (gst_structure_get_fraction (structure, "framerate", &numerator, &denominator))
 		{
-			FILE *f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "w");
-			if (f)
+			int valid_framerates[] = { 23976, 24000, 25000, 29970, 30000, 50000, 59940, 60000 };
+			int framerate = (int)(((double)numerator * 1000) / denominator);
+			int diff = 60000;
+			int best = 0;
+			int i = 0;
+			for (; i < 7; ++i)
 			{
-				int valid_framerates[] = { 23976, 24000, 25000, 29970, 30000, 50000, 59940, 60000 };
-				int framerate = (int)(((double)numerator * 1000) / denominator);
-				int diff = 60000;
-				int best = 0;
-				int i = 0;
-				for (; i < 7; ++i)
+				int ndiff = abs(framerate - valid_framerates[i]);
+				if (ndiff < diff)
 				{
-					int ndiff = abs(framerate - valid_framerates[i]);
-					if (ndiff < diff)
-					{
-						diff = ndiff;
-						best = i;
-					}
+					diff = ndiff;
+					best = i;
+				}
+			}
+			/* a reclaimed decoder may already be set to this framerate */
+			if (!self->device || self->device->fallback_framerate != valid_framerates[best])
+			{
+				FILE *f = fopen(self->fallback_framerate_path, "w");
+				if (f)
+				{
+					fprintf(f, "%d", valid_framerates[best]);
+					fclose(f);
+					if (self->device) self->device->fallback_framerate = valid_framerates[best];
 				}
-				fprintf(f, "%d", valid_framerates[best]);
-				fclose(f);
 			}
 		}
 		if (self->playing && self->stream_type != prev_stream_type)
@@ -1635,16 +1981,39 @@ static gboolean gst_dvbvideosink_start(GstBaseSink *basesink)
 	fcntl(self->unlockfd[1], F_SETFL, O_NONBLOCK);
 
 	self->pesheader_buffer = gst_buffer_new_and_alloc(2048);
+	self->gather_spans = g_array_new(FALSE, FALSE, sizeof(dvb_span_t));
+	self->gather_headers = g_byte_array_new();
 
-	f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "r");
-	if (f)
+	sprintf(self->fallback_framerate_path, "/proc/stb/vmpeg/%d/fallback_framerate", self->decoder);
+	self->device = dvb_device_open(DVB_DEVICE_VIDEO, self->adapter, self->decoder);
+	self->fd = self->device ? self->device->fd : -1;
+
+	if (self->device && self->device->saved_fallback_framerate[0])
 	{
-		fgets(self->saved_fallback_framerate, sizeof(self->saved_fallback_framerate), f);
-		fclose(f);
-		f = NULL;
+		/* reclaimed a parked decoder, /proc still has the framerate of the previous clip */
+		strcpy(self->saved_fallback_framerate, self->device->saved_fallback_framerate);
+		self->device->saved_fallback_framerate[0] = 0;
+	}
+	else
+	{
+		f = fopen(self->fallback_framerate_path, "r");
+		if (f)
+		{
+			fgets(self->saved_fallback_framerate, sizeof(self->saved_fallback_framerate), f);
+			fclose(f);
+			f = NULL;
+		}
 	}
 
-	self->fd = open("/dev/dvb/adapter0/video0", O_RDWR | O_NONBLOCK);
+	if (self->device && self->device->playing)
+	{
+		/* keep the decoder running, set_caps only reprograms it when the stream type differs */
+		GST_INFO_OBJECT(self, "reclaimed running decoder, stream type %d", self->device->stream_type);
+		ioctl(self->fd, VIDEO_CLEAR_BUFFER);
+		self->playing = TRUE;
+		self->stream_type = self->device->stream_type;
+		self->device->playing = FALSE;
+	}
 
 	self->pts_written = FALSE;
 	self->lastpts = 0;
@@ -1662,22 +2031,39 @@ static gboolean gst_dvbvideosink_stop(GstBaseSink *basesink)
 {
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK(basesink);
 	FILE *f = NULL;
+	gboolean parked = FALSE;
 	GST_INFO_OBJECT(self, "stop");
+	dvb_reset_lead(&self->io);
 	if (self->fd >= 0)
 	{
-		if (self->playing)
+		if (self->playing && !self->keep_device_open)
 		{
 			ioctl(self->fd, VIDEO_STOP);
 			self->playing = FALSE;
 		}
 		if (self->rate != 1.0)
 		{
-			ioctl(self->fd, VIDEO_SLOWMOTION, 0);
-			ioctl(self->fd, VIDEO_FAST_FORWARD, 0);
+			dvb_device_set_rate(self->adapter, self->decoder, 1.0);
 			self->rate = 1.0;
 		}
-		ioctl(self->fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_DEMUX);
-		close(self->fd);
+		/* leave the decoder as it is, the registry stops it when no sink reclaims it in time */
+		if (self->keep_device_open && dvb_device_park(self->device, self->playing, self->stream_type, self->saved_fallback_framerate))
+		{
+			self->playing = FALSE;
+			parked = TRUE;
+		}
+		else
+		{
+			if (self->playing)
+			{
+				ioctl(self->fd, VIDEO_STOP);
+				self->playing = FALSE;
+			}
+			ioctl(self->fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_DEMUX);
+			self->device->source = VIDEO_SOURCE_DEMUX;
+			dvb_device_close(self->device);
+		}
+		self->device = NULL;
 		self->fd = -1;
 	}
 
@@ -1693,12 +2079,25 @@ static gboolean gst_dvbvideosink_stop(GstBaseSink *basesink)
 		self->pesheader_buffer = NULL;
 	}
 
+	self->prepared = NULL;
+	if (self->gather_spans)
+	{
+		video_gather_clear(self);
+		g_array_free(self->gather_spans, TRUE);
+		g_byte_array_free(self->gather_headers, TRUE);
+		self->gather_spans = NULL;
+		self->gather_headers = NULL;
+	}
+
 	while (self->queue)
 	{
 		queue_pop(&self->queue);
 	}
 
-	f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "w");
+	mpeg4p2_unpacker_reset(&self->mpeg4p2);
+	self->unpack_mpeg4p2 = FALSE;
+
+	f = parked ? NULL : fopen(self->fallback_framerate_path, "w");
 	if (f)
 	{
 		fputs(self->saved_fallback_framerate, f);
@@ -1743,13 +2142,13 @@ static GstStateChangeReturn gst_dvbvideosink_change_state(GstElement *element, G
 			GstMessage *msg;
 			int aspect = -1, width = -1, height = -1, framerate = -1, progressive = -1;
 
-			progressive = readMpegProc("progressive", 0);
+			progressive = readMpegProc("progressive", self->decoder);
 
 			if(readApiSize(self->fd, &width, &height, &aspect) == -1)
 			{
-				aspect = readMpegProc("aspect", 0);
-				width = readMpegProc("xres", 0);
-				height = readMpegProc("yres", 0);
+				aspect = readMpegProc("aspect", self->decoder);
+				width = readMpegProc("xres", self->decoder);
+				height = readMpegProc("yres", self->decoder);
 			}
 			else
 			{
@@ -1758,7 +2157,7 @@ static GstStateChangeReturn gst_dvbvideosink_change_state(GstElement *element, G
 
 			if(readApiFrameRate(self->fd, &framerate) == -1)
 			{
-				framerate = readMpegProc("framerate", 0);
+				framerate = readMpegProc("framerate", self->decoder);
 			}
 
 			s = gst_structure_new ("eventSizeAvail",
@@ -1778,15 +2177,19 @@ static GstStateChangeReturn gst_dvbvideosink_change_state(GstElement *element, G
 			msg = gst_message_new_element (GST_OBJECT (element), s);
 			gst_element_post_message (GST_ELEMENT (element), msg);
 #endif
-			ioctl(self->fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_MEMORY);
-			ioctl(self->fd, VIDEO_FREEZE);
+			if (self->device->source != VIDEO_SOURCE_MEMORY)
+			{
+				ioctl(self->fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_MEMORY);
+				self->device->source = VIDEO_SOURCE_MEMORY;
+			}
+			dvb_device_video_freeze(self->device, TRUE);
 		}
 		if(get_downmix_ready())
 			self->using_dts_downmix = TRUE;
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 		GST_INFO_OBJECT (self,"GST_STATE_CHANGE_PAUSED_TO_PLAYING");
-		if (self->fd >= 0 && self->paused) ioctl(self->fd, VIDEO_CONTINUE);
+		if (self->fd >= 0 && self->paused) dvb_device_video_freeze(self->device, FALSE);
 		self->first_paused = FALSE;
 		self->paused = FALSE;
 		break;
@@ -1801,7 +2204,7 @@ static GstStateChangeReturn gst_dvbvideosink_change_state(GstElement *element, G
 	case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
 		GST_INFO_OBJECT (self,"GST_STATE_CHANGE_PLAYING_TO_PAUSED");
 		self->paused = TRUE;
-		if (self->fd >= 0) ioctl(self->fd, VIDEO_FREEZE);
+		if (self->fd >= 0) dvb_device_video_freeze(self->device, TRUE);
 		/* wakeup the poll */
 		write(self->unlockfd[1], "\x01", 1);
 		break;
@@ -104,6 +104,7 @@ struct _GstDVBVideoSink
 {
 	GstBaseSink element;
 
+	dvb_device_t *device;
 	int fd;
 	int unlockfd[2];
 
@@ -118,6 +119,7 @@ struct _GstDVBVideoSink
 	gboolean use_dts;
 
 	char saved_fallback_framerate[16];
+	char fallback_framerate_path[64];
 
 	gdouble rate;
 	gboolean playing, paused, flushing, unlocking, flushed, first_paused;
@@ -129,8 +131,32 @@ struct _GstDVBVideoSink
 	gint8 ok_to_write;
 
 	gboolean use_set_encoding;
+	gboolean keep_device_open;
+	int adapter, decoder;
 
 	queue_entry_t *queue;
+	/* what the write loops shared with the audio sink see of this one */
+	dvb_sink_io_t io;
+
+	/* render_list collects the writes of all its buffers into one writev */
+	gboolean gathering;
+	GArray *gather_spans;
+	GByteArray *gather_headers;
+	/* what prepare gathered the spans for, render only writes them */
+	gconstpointer prepared;
+	/* what the packetizing in prepare changed, put back when it is dropped */
+	gboolean prepared_must_send_header, prepared_pts_written, prepared_audelim_written;
+	/* pts of the last gathered frame, what video_pace() waits for */
+	GstClockTime gather_pts;
+
+	/* target lead of the written data over the decoder pts, 0 is off */
+	GstClockTime pacing_lead;
+	/* lead the writes are capped at and below which buffering is posted */
+	GstClockTime lead_high_watermark, lead_low_watermark;
+
+	/* packed MPEG-4 part 2 is unpacked and retimed before it is written */
+	gboolean unpack_mpeg4p2;
+	mpeg4p2_unpacker_t mpeg4p2;
 };
 
 struct _GstDVBVideoSinkClass 
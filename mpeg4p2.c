@@ -0,0 +1,492 @@
+/*
+ *Unpacking routines are based on https://github.com/FFmpeg/FFmpeg/blob/master/libavcodec/mpeg4_unpack_bframes_bsf.c
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include "mpeg4p2.h"
+
+/* same category name as the element, both users log under one name */
+GST_DEBUG_CATEGORY_STATIC(mpeg4p2unpack_debug);
+#define GST_CAT_DEFAULT (mpeg4p2unpack_debug)
+
+static unsigned int mpeg4p2_find_startcode(const uint8_t *buf, int buf_size, int *pos)
+{
+	unsigned int startcode = 0xFF;
+
+	for (; *pos < buf_size;)
+	{
+		startcode = ((startcode << 8) | buf[*pos]) & 0xFFFFFFFF;
+		*pos +=1;
+		if ((startcode & 0xFFFFFF00) != 0x100)
+			continue;  /* no startcode */
+		return startcode;
+	}
+
+	return 0;
+}
+
+/* determine the position of the packed marker in the userdata,
+ * the number of VOPs, the position of the second VOP and the coding type
+ * of the first non sprite VOP before (vop_type[0]) and from (vop_type[1])
+ * the second VOP on, MPEG4P2_VOP_TYPE_NONE when there is none */
+static void mpeg4p2_scan_buffer(const uint8_t *buf, int buf_size, int *pos_p, int *nb_vop, int *pos_vop2, int *vop_type)
+{
+	unsigned int startcode;
+	int pos, i, type;
+
+	vop_type[0] = vop_type[1] = MPEG4P2_VOP_TYPE_NONE;
+
+	for (pos = 0; pos < buf_size;)
+	{
+		startcode = mpeg4p2_find_startcode(buf, buf_size, &pos);
+
+		if (startcode == MPEG4P2_USER_DATA_STARTCODE && pos_p)
+		{
+			/* check if the (DivX) userdata string ends with 'p' (packed) */
+			for (i = 0; i < 255 && pos + i + 1 < buf_size; i++)
+			{
+				if (buf[pos + i] == 'p' && buf[pos + i + 1] == '\0')
+				{
+					*pos_p = pos + i;
+					break;
+				}
+			}
+		}
+		else if (startcode == MPEG4P2_VOP_STARTCODE && nb_vop)
+		{
+			*nb_vop += 1;
+			if (*nb_vop == 2 && pos_vop2)
+			{
+				*pos_vop2 = pos - 4; /* subtract 4 bytes startcode */
+			}
+			if (pos < buf_size)
+			{
+				/* vop_coding_type, the two bits after the startcode */
+				type = (buf[pos] & 0xC0) >> 6;
+				i = *nb_vop == 1 ? 0 : 1;
+				if (type != MPEG4P2_VOP_TYPE_S && vop_type[i] == MPEG4P2_VOP_TYPE_NONE)
+					vop_type[i] = type;
+			}
+		}
+	}
+}
+
+void mpeg4p2_unpacker_init(mpeg4p2_unpacker_t *unpacker, GstObject *parent, mpeg4p2_push_func push, mpeg4p2_push_list_func push_list, gpointer user_data)
+{
+	if (!mpeg4p2unpack_debug)
+	{
+		GST_DEBUG_CATEGORY_INIT(mpeg4p2unpack_debug, "mpeg4p2unpack", 0, "MPEG4-Part2 video unpacker");
+	}
+
+	unpacker->parent = parent;
+	unpacker->push = push;
+	unpacker->push_list = push_list;
+	unpacker->user_data = user_data;
+
+	unpacker->b_frame = NULL;
+	unpacker->b_frame_type = MPEG4P2_VOP_TYPE_NONE;
+	unpacker->b_frames = NULL;
+	unpacker->b_frames_size = 0;
+	unpacker->b_frames_count = 0;
+	unpacker->b_frames_bytes = 0;
+	unpacker->passthrough = FALSE;
+	unpacker->estimate_pts = FALSE;
+	unpacker->reorder_depth = 0;
+	unpacker->latency_changed = FALSE;
+	unpacker->first_ip_frame_written = FALSE;
+	unpacker->second_ip_frame = NULL;
+	unpacker->buffer_duration = GST_CLOCK_TIME_NONE;
+}
+
+/* frame duration from the framerate, without one the duration of the
+ * first buffer is used */
+void mpeg4p2_unpacker_set_caps(mpeg4p2_unpacker_t *unpacker, const GstStructure *structure)
+{
+	gint numerator, denominator;
+
+	if (gst_structure_get_fraction(structure, "framerate", &numerator, &denominator) && numerator > 0 && denominator > 0)
+	{
+		unpacker->buffer_duration = 1000 / ((double)numerator * 1000 / denominator) * GST_SECOND;
+	}
+}
+
+static void mpeg4p2_unpacker_set_depth(mpeg4p2_unpacker_t *unpacker, guint depth)
+{
+	if (depth != unpacker->reorder_depth)
+	{
+		GST_DEBUG_OBJECT(unpacker->parent, "reorder depth %u -> %u frames", unpacker->reorder_depth, depth);
+		unpacker->reorder_depth = depth;
+		unpacker->latency_changed = TRUE;
+	}
+}
+
+/* the one B-frame past the limits still goes into the group it overflows */
+static void mpeg4p2_unpacker_append_b_frame(mpeg4p2_unpacker_t *unpacker, GstBuffer *buffer)
+{
+	if (unpacker->b_frames_count == unpacker->b_frames_size)
+	{
+		unpacker->b_frames_size = unpacker->b_frames_size ? MIN(unpacker->b_frames_size * 2, MPEG4P2_MAX_B_FRAMES_COUNT + 1) : MPEG4P2_B_FRAMES_PREALLOC;
+		unpacker->b_frames = g_renew(GstBuffer *, unpacker->b_frames, unpacker->b_frames_size);
+		GST_DEBUG_OBJECT(unpacker->parent, "room for %d B-frames", unpacker->b_frames_size);
+	}
+	unpacker->b_frames[unpacker->b_frames_count++] = buffer;
+	unpacker->b_frames_bytes += gst_buffer_get_size(buffer);
+}
+
+/* stores a B-frame until the next I/P-frame, FALSE when it doesn't fit the limits */
+static gboolean mpeg4p2_unpacker_store_b_frame(mpeg4p2_unpacker_t *unpacker, GstBuffer *buffer)
+{
+	gsize size = gst_buffer_get_size(buffer);
+
+	if (unpacker->b_frames_count == MPEG4P2_MAX_B_FRAMES_COUNT || unpacker->b_frames_bytes + size > MPEG4P2_MAX_B_FRAMES_BYTES)
+	{
+		return FALSE;
+	}
+	mpeg4p2_unpacker_append_b_frame(unpacker, buffer);
+	/* the stored I/P-frame waits for all of them */
+	if ((guint)unpacker->b_frames_count + 1 > unpacker->reorder_depth)
+	{
+		mpeg4p2_unpacker_set_depth(unpacker, unpacker->b_frames_count + 1);
+	}
+	return TRUE;
+}
+
+/* drops every stored frame, the stream restarts with the next I/P-frame */
+void mpeg4p2_unpacker_flush(mpeg4p2_unpacker_t *unpacker)
+{
+	gint i;
+
+	for (i = 0; i < unpacker->b_frames_count; i++)
+	{
+		gst_buffer_unref(unpacker->b_frames[i]);
+		unpacker->b_frames[i] = NULL;
+	}
+	if (unpacker->second_ip_frame)
+	{
+		gst_buffer_unref(unpacker->second_ip_frame);
+		unpacker->second_ip_frame = NULL;
+	}
+	if (unpacker->b_frame)
+	{
+		gst_buffer_unref(unpacker->b_frame);
+		unpacker->b_frame = NULL;
+	}
+	unpacker->b_frames_count = 0;
+	unpacker->b_frames_bytes = 0;
+	unpacker->first_ip_frame_written = FALSE;
+	unpacker->estimate_pts = FALSE;
+}
+
+/* flush and forget what was learned about the stream */
+void mpeg4p2_unpacker_reset(mpeg4p2_unpacker_t *unpacker)
+{
+	mpeg4p2_unpacker_flush(unpacker);
+	g_free(unpacker->b_frames);
+	unpacker->b_frames = NULL;
+	unpacker->b_frames_size = 0;
+	unpacker->passthrough = FALSE;
+	unpacker->buffer_duration = GST_CLOCK_TIME_NONE;
+	mpeg4p2_unpacker_set_depth(unpacker, 0);
+}
+
+/* how long the first frame of a reordered group waits for the group to complete */
+GstClockTime mpeg4p2_unpacker_get_latency(mpeg4p2_unpacker_t *unpacker)
+{
+	if (unpacker->buffer_duration == GST_CLOCK_TIME_NONE)
+	{
+		return 0;
+	}
+	return unpacker->reorder_depth * unpacker->buffer_duration;
+}
+
+static GstFlowReturn mpeg4p2_unpacker_push_list(mpeg4p2_unpacker_t *unpacker, GstBufferList *list)
+{
+	GstFlowReturn ret = GST_FLOW_OK;
+	guint i, len;
+
+	if (unpacker->push_list)
+	{
+		return unpacker->push_list(unpacker->user_data, list);
+	}
+
+	len = gst_buffer_list_length(list);
+	for (i = 0; i < len && ret == GST_FLOW_OK; i++)
+	{
+		ret = unpacker->push(unpacker->user_data, gst_buffer_ref(gst_buffer_list_get(list, i)));
+	}
+	gst_buffer_list_unref(list);
+	return ret;
+}
+
+/* pushes the stored I/P-frame and the B-frames that follow it in decoding
+ * order, all with their PTS reconstructed
+ * .P0. <P1> -> PTS(P1) = DTS(P1), push P1
+ * .P0. <P1,B1,B2..Bx> -> PTS(P1) = DTS(Bx), PTS(B1) = DTS(P1), PTS(By) = DTS(By-1), push P1 B1..Bx */
+static GstFlowReturn mpeg4p2_unpacker_push_group(mpeg4p2_unpacker_t *unpacker)
+{
+	GstBufferList *list;
+	GstBuffer *ip_frame = unpacker->second_ip_frame;
+	gint i;
+
+	unpacker->second_ip_frame = NULL;
+	if (!unpacker->b_frames_count)
+	{
+		GST_BUFFER_PTS(ip_frame) = GST_BUFFER_DTS(ip_frame) + unpacker->buffer_duration;
+		return unpacker->push(unpacker->user_data, ip_frame);
+	}
+
+	// (DTS)IPB1B2B3 -> (PTS)IB1B2B3P
+
+	// (PTS)P = (DTS)B3
+	GST_BUFFER_PTS(ip_frame) = GST_BUFFER_DTS(unpacker->b_frames[unpacker->b_frames_count-1]) + unpacker->buffer_duration;
+	// (PTS)B1 = (DTS)P
+	GST_BUFFER_PTS(unpacker->b_frames[0]) = GST_BUFFER_DTS(ip_frame) + unpacker->buffer_duration;
+	for (i=1; i < unpacker->b_frames_count; i++)
+	{
+		// (PTS)B2 = (DTS)B1
+		// (PTS)B3 = (DTS)B2
+		// ..
+		GST_BUFFER_PTS(unpacker->b_frames[i]) = GST_BUFFER_DTS(unpacker->b_frames[i-1]) + unpacker->buffer_duration;
+	}
+	/* the whole reordered group goes downstream in one push */
+	list = gst_buffer_list_new_sized(unpacker->b_frames_count + 1);
+	gst_buffer_list_add(list, ip_frame);
+	for (i=0; i < unpacker->b_frames_count; i++)
+	{
+		gst_buffer_list_add(list, unpacker->b_frames[i]);
+		unpacker->b_frames[i] = NULL;
+	}
+	unpacker->b_frames_count = 0;
+	unpacker->b_frames_bytes = 0;
+	return mpeg4p2_unpacker_push_list(unpacker, list);
+}
+
+static GstFlowReturn mpeg4p2_unpacker_handle_frame(mpeg4p2_unpacker_t *unpacker, GstBuffer *buffer, int vop_type);
+
+GstFlowReturn mpeg4p2_unpacker_chain(mpeg4p2_unpacker_t *unpacker, GstBuffer *buffer)
+{
+	guint8 *data;
+	gsize data_len;
+	GstMapInfo buffermap;
+	GstFlowReturn ret = GST_FLOW_OK;
+
+	if (unpacker->buffer_duration == GST_CLOCK_TIME_NONE)
+	{
+		if (!GST_BUFFER_DURATION_IS_VALID(buffer))
+		{
+			GST_WARNING_OBJECT(unpacker->parent, "Cannot retrieve buffer duration, dropping");
+			gst_buffer_unref(buffer);
+			return GST_FLOW_OK;
+		}
+		unpacker->buffer_duration = GST_BUFFER_DURATION(buffer);
+	}
+
+	gst_buffer_map(buffer, &buffermap, GST_MAP_READ);
+	data = buffermap.data;
+	data_len = buffermap.size;
+
+	int pos_p = -1, nb_vop = 0, pos_vop2 = -1, vop_type[2];
+	mpeg4p2_scan_buffer(data, data_len, &pos_p, &nb_vop, &pos_vop2, vop_type);
+	// GST_LOG_OBJECT(unpacker->parent, "pos_p=%d, num_vop=%d, pos_vop2=%d", pos_p, nb_vop, pos_vop2);
+
+	/* if we don't have userdata we can unmap buffer */
+	if (pos_p < 0)
+	{
+		gst_buffer_unmap(buffer, &buffermap);
+		data = NULL;
+	}
+
+	if (pos_vop2 >= 0)
+	{
+		if (unpacker->b_frame)
+		{
+			GST_WARNING_OBJECT(unpacker->parent, "Missing one N-VOP packet, discarding one B-frame");
+			gst_buffer_unref(unpacker->b_frame);
+			unpacker->b_frame = NULL;
+		}
+		// GST_LOG_OBJECT(unpacker->parent, "Storing B-Frame of packed PB-Frame");
+		unpacker->b_frame = gst_buffer_copy_region(buffer, GST_BUFFER_COPY_ALL, pos_vop2, data_len - pos_vop2);
+		unpacker->b_frame_type = vop_type[1];
+		GST_BUFFER_DTS(unpacker->b_frame) = GST_BUFFER_DTS(buffer) + unpacker->buffer_duration;
+	}
+
+	if (nb_vop > 2)
+	{
+		GST_WARNING_OBJECT(unpacker->parent, "Found %d VOP headers in one packet, only unpacking one.", nb_vop);
+	}
+
+	if (nb_vop == 1 && unpacker->b_frame)
+	{
+		// GST_LOG_OBJECT(unpacker->parent, "Push previous B-Frame");
+		ret = mpeg4p2_unpacker_handle_frame(unpacker, unpacker->b_frame, unpacker->b_frame_type);
+		if (data_len <= MPEG4P2_MAX_NVOP_SIZE)
+		{
+			// GST_LOG_OBJECT(unpacker->parent, "Skipping N-VOP");
+			unpacker->b_frame = NULL;
+			gst_buffer_unref(buffer);
+		}
+		else
+		{
+			// GST_LOG_OBJECT(unpacker->parent, "Store B-Frame");
+			GST_BUFFER_DTS(buffer) = GST_BUFFER_DTS(unpacker->b_frame) + unpacker->buffer_duration;
+			unpacker->b_frame = buffer;
+			unpacker->b_frame_type = vop_type[0];
+		}
+	}
+	else if (nb_vop >= 2)
+	{
+		// GST_LOG_OBJECT(unpacker->parent, "Push P-frame of packed PB-Frame");
+		GstBuffer *p_frame = gst_buffer_copy_region(buffer, GST_BUFFER_COPY_ALL, 0, pos_vop2);
+		ret = mpeg4p2_unpacker_handle_frame(unpacker, p_frame, vop_type[0]);
+		gst_buffer_unref(buffer);
+	}
+	else if (pos_p >= 0)
+	{
+		// GST_LOG_OBJECT(unpacker->parent, "Updating DivX userdata (replacing trailing 'p')");
+		gst_buffer_unmap(buffer, &buffermap);
+		gst_buffer_map(buffer, &buffermap, GST_MAP_WRITE);
+		data = buffermap.data;
+		data[pos_p] = 'n';
+		gst_buffer_unmap(buffer, &buffermap);
+		data = NULL;
+		ret = mpeg4p2_unpacker_handle_frame(unpacker, buffer, vop_type[0] != MPEG4P2_VOP_TYPE_NONE ? vop_type[0] : vop_type[1]);
+	}
+	else
+	{
+		ret = mpeg4p2_unpacker_handle_frame(unpacker, buffer, vop_type[0] != MPEG4P2_VOP_TYPE_NONE ? vop_type[0] : vop_type[1]);
+	}
+	return ret;
+}
+
+/* computes PTS from DTS, for better ilustration see:
+ * https://software.intel.com/sites/default/files/pts-dts_shift_explain.gif */
+static GstFlowReturn mpeg4p2_unpacker_handle_frame(mpeg4p2_unpacker_t *unpacker, GstBuffer *buffer, int vop_type)
+{
+	/* matroska container know only about PTS */
+	if(unpacker->passthrough || !GST_BUFFER_DTS_IS_VALID(buffer))
+	{
+		return unpacker->push(unpacker->user_data, buffer);
+	}
+
+	GstFlowReturn ret = GST_FLOW_OK;
+
+	if (unpacker->estimate_pts)
+	{
+		/* the rest of a B-run that overflowed goes out in decoding order */
+		if (vop_type == MPEG4P2_VOP_TYPE_B)
+		{
+			if (!GST_BUFFER_PTS_IS_VALID(buffer))
+			{
+				GST_BUFFER_PTS(buffer) = GST_BUFFER_DTS(buffer) + unpacker->buffer_duration;
+			}
+			goto push_buffer;
+		}
+		/* reordering picks up again with the next I/P-frame */
+		if (vop_type != MPEG4P2_VOP_TYPE_NONE)
+		{
+			unpacker->estimate_pts = FALSE;
+		}
+	}
+
+	/* vop_type comes from the scan in chain, the buffer isn't looked at again */
+	{
+		// .X. - means pushed X-frame
+		// <X> - means stored X-frame
+		// [X] - means current X-frame
+
+		switch (vop_type)
+		{
+			case MPEG4P2_VOP_TYPE_I: // I-Frame
+			case MPEG4P2_VOP_TYPE_P: // P-Frame
+				// . . < > [P] -> PTS(P) = DTS(P), push P
+				if (!unpacker->first_ip_frame_written)
+				{
+					// GST_LOG_OBJECT(unpacker->parent, "First (IP)-Frame pushed");
+					unpacker->first_ip_frame_written = TRUE;
+					GST_BUFFER_PTS(buffer) = GST_BUFFER_DTS(buffer) + unpacker->buffer_duration;
+					goto push_buffer;
+				}
+				// .P0. < > [P1] -> store P1
+				else if (!unpacker->second_ip_frame)
+				{
+					// GST_LOG_OBJECT(unpacker->parent, "Store second (IP)-Frame (1)");
+					unpacker->second_ip_frame = buffer;
+					if (!unpacker->reorder_depth)
+					{
+						mpeg4p2_unpacker_set_depth(unpacker, 1);
+					}
+					goto done;
+				}
+				else
+				{
+					// GST_LOG_OBJECT(unpacker->parent, "B-Frames count in between (IP)-Frames = %d", unpacker->b_frames_count);
+					ret = mpeg4p2_unpacker_push_group(unpacker);
+					if (ret != GST_FLOW_OK)
+					{
+						GST_DEBUG_OBJECT(unpacker->parent, "Error when pushing buffer list");
+						goto drop_buffer;
+					}
+					unpacker->second_ip_frame = buffer;
+					// GST_LOG_OBJECT(unpacker->parent, "Store second (IP)-Frame (2)");
+					goto done;
+				}
+				break;
+			case MPEG4P2_VOP_TYPE_NONE: // only S-Frames or no VOP at all
+				break;
+			case MPEG4P2_VOP_TYPE_B: // B-Frame
+				if (!unpacker->second_ip_frame)
+				{
+					GST_INFO_OBJECT(unpacker->parent, "Cannot predict B-Frame without surrounding I/P-Frames, dropping...");
+					goto drop_buffer;
+				}
+				if (GST_BUFFER_PTS (buffer) != GST_CLOCK_TIME_NONE)
+				{
+					GST_INFO_OBJECT(unpacker->parent, "We have B frames with PTS timestamps set! setting passthrough mode");
+					ret = unpacker->push(unpacker->user_data, unpacker->second_ip_frame);
+					unpacker->second_ip_frame = NULL;
+					if (ret != GST_FLOW_OK)
+					{
+						GST_DEBUG_OBJECT(unpacker->parent, "Error when pushing buffer (3)");
+						goto drop_buffer;
+					}
+					unpacker->passthrough = TRUE;
+					goto push_buffer;
+				}
+				else if (!mpeg4p2_unpacker_store_b_frame(unpacker, buffer))
+				{
+					GST_WARNING_OBJECT(unpacker->parent, "More than %d B-frames or %d bytes of them in a row, passing the rest of the run through with estimated PTS",
+							MPEG4P2_MAX_B_FRAMES_COUNT, MPEG4P2_MAX_B_FRAMES_BYTES);
+					/* this one still closes the group, which takes over the buffer */
+					mpeg4p2_unpacker_append_b_frame(unpacker, buffer);
+					unpacker->estimate_pts = TRUE;
+					ret = mpeg4p2_unpacker_push_group(unpacker);
+					if (ret != GST_FLOW_OK)
+					{
+						GST_DEBUG_OBJECT(unpacker->parent, "Error when pushing buffer list");
+					}
+					goto done;
+				}
+				else
+				{
+					// GST_LOG_OBJECT(unpacker->parent, "Store B-Frame [%d]", unpacker->b_frames_count);
+					goto done;
+				}
+				break;
+			default:
+				g_warning("unhandled divx5/xvid frame type %d\n", vop_type);
+				break;
+		}
+	}
+push_buffer:
+	return unpacker->push(unpacker->user_data, buffer);
+drop_buffer:
+	gst_buffer_unref(buffer);
+	return ret;
+done:
+	return ret;
+}
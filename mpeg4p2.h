@@ -0,0 +1,67 @@
+#ifndef _mpeg4p2_h
+#define _mpeg4p2_h
+
+#include <stdint.h>
+
+#define MPEG4P2_MAX_NVOP_SIZE        8
+/* room for the B-frames of typical GOPs is allocated up front and grown
+ * on demand, past either limit the stream is passed through with
+ * estimated timestamps */
+#define MPEG4P2_B_FRAMES_PREALLOC    8
+#define MPEG4P2_MAX_B_FRAMES_COUNT   64
+#define MPEG4P2_MAX_B_FRAMES_BYTES   (8 * 1024 * 1024)
+#define MPEG4P2_VOP_STARTCODE        0x1B6
+#define MPEG4P2_USER_DATA_STARTCODE  0x1B2
+
+/* vop_coding_type, NONE when a frame has no I/P/B VOP */
+#define MPEG4P2_VOP_TYPE_NONE        -1
+#define MPEG4P2_VOP_TYPE_I           0
+#define MPEG4P2_VOP_TYPE_P           1
+#define MPEG4P2_VOP_TYPE_B           2
+#define MPEG4P2_VOP_TYPE_S           3
+
+/* both take ownership of what they are given */
+typedef GstFlowReturn (*mpeg4p2_push_func)(gpointer user_data, GstBuffer *buffer);
+typedef GstFlowReturn (*mpeg4p2_push_list_func)(gpointer user_data, GstBufferList *list);
+
+/*
+ * packed bitstream unpacker and DTS to PTS reconstruction, shared by the
+ * mpeg4p2unpack element and the inline stage of dvbvideosink
+ */
+typedef struct mpeg4p2_unpacker
+{
+	GstObject *parent; /* only used for logging */
+	mpeg4p2_push_func push;
+	mpeg4p2_push_list_func push_list; /* optional, falls back to push */
+	gpointer user_data;
+
+	/* unpacking mpeg4p2 */
+	GstBuffer *b_frame;
+	int b_frame_type;
+
+	/* computing PTS from DTS for mpeg4p2 */
+	gint b_frames_count;
+	gboolean first_ip_frame_written, passthrough;
+	GstBuffer **b_frames;
+	gint b_frames_size;
+	gsize b_frames_bytes;
+	GstBuffer *second_ip_frame;
+	GstClockTime buffer_duration;
+	/* the rest of a B-run past the reorder limits is passed through with
+	 * PTS = DTS + duration, until the next I/P-frame */
+	gboolean estimate_pts;
+
+	/* most frames held back so far, set latency_changed when it grows,
+	 * the user clears it once the new latency is announced */
+	guint reorder_depth;
+	gboolean latency_changed;
+} mpeg4p2_unpacker_t;
+
+void mpeg4p2_unpacker_init(mpeg4p2_unpacker_t *unpacker, GstObject *parent, mpeg4p2_push_func push, mpeg4p2_push_list_func push_list, gpointer user_data);
+void mpeg4p2_unpacker_set_caps(mpeg4p2_unpacker_t *unpacker, const GstStructure *structure);
+void mpeg4p2_unpacker_flush(mpeg4p2_unpacker_t *unpacker);
+void mpeg4p2_unpacker_reset(mpeg4p2_unpacker_t *unpacker);
+GstClockTime mpeg4p2_unpacker_get_latency(mpeg4p2_unpacker_t *unpacker);
+GstFlowReturn mpeg4p2_unpacker_chain(mpeg4p2_unpacker_t *unpacker, GstBuffer *buffer);
+
+#endif